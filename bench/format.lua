@@ -0,0 +1,210 @@
+--
+-- benchmark of format() compared with string.format on the typical workloads
+--
+-- usage: lua bench/format.lua [scale]
+--
+-- the number of iterations of each workload is multiplied by scale.
+-- alloc is the memory allocated by lua per call while the GC is stopped.
+--
+-- if the module is built with STRING_FORMAT_ALLOC_STATS=1, the number and the
+-- size of the allocations by lua_Alloc and malloc are counted per call, and
+-- those of format() are broken down by the conversion type.
+--
+local format = require('string.format')
+local gettime = require('time.clock').gettime
+local unpack = unpack or table.unpack
+local scale = tonumber(arg[1]) or 1
+
+--- build a payload of the given size by repeating the record
+--- @param rec string
+--- @param size integer
+--- @return string
+local function payload(rec, size)
+    local n = math.ceil(size / #rec)
+    return string.sub(string.rep(rec, n), 1, size)
+end
+
+--- build the format string and the arguments of n placeholders
+--- @param n integer
+--- @return string fmt
+--- @return any[] args
+local function wide(n)
+    local fmts = {}
+    local args = {}
+    for i = 1, n do
+        if i % 2 == 0 then
+            fmts[i] = 'k' .. i .. '=%d'
+            args[i] = i * 7919
+        else
+            fmts[i] = 'k' .. i .. '=%s'
+            args[i] = 'v' .. i
+        end
+    end
+    return table.concat(fmts, ' '), args
+end
+
+local WIDE_FMT, WIDE_ARGS = wide(120)
+local WORKLOADS = {
+    {
+        name = 'integer log',
+        niter = 200000,
+        fmt = '%s [%d] pid=%d tid=%d status=%d bytes=%d time=%dms\n',
+        args = {
+            'GET /index.html',
+            1700000000,
+            12345,
+            678,
+            200,
+            1532,
+            12,
+        },
+    },
+    {
+        name = 'short %s',
+        niter = 200000,
+        fmt = '%s %s %s %s %s %s %s %s %s %s',
+        args = {
+            'a',
+            'bc',
+            'def',
+            'ghij',
+            'k',
+            'lm',
+            'nop',
+            'qrst',
+            'u',
+            'vw',
+        },
+    },
+    {
+        name = 'long %q',
+        niter = 2000,
+        fmt = '%q',
+        args = {
+            payload('{"id": 12345, "name": "example user", "note": ' ..
+                        '"lorem ipsum\tdolor"},\n', 16 * 1024),
+        },
+    },
+    {
+        name = 'float',
+        niter = 100000,
+        fmt = '%.3f %g %e %.10g %f',
+        args = {
+            3.14159265358979,
+            1e-5,
+            -123456.789,
+            2 / 3,
+            1e10,
+        },
+    },
+    {
+        name = 'wide',
+        niter = 10000,
+        fmt = WIDE_FMT,
+        args = WIDE_ARGS,
+    },
+    {
+        name = '* width',
+        niter = 100000,
+        fmt = '%*d|%-*s|%.*f',
+        args = {
+            8,
+            42,
+            -12,
+            'name',
+            3,
+            1.5,
+        },
+        -- string.format does not support '*', so the format string is
+        -- built by itself
+        std = function(_, w1, v1, w2, v2, p, v3)
+            return string.format(string.format('%%%dd|%%%ds|%%.%df', w1, w2,
+                                               p), v1, v2, v3)
+        end,
+    },
+}
+
+--- measure fn(fmt, ...) of the workload
+--- @param fn function
+--- @param w table
+--- @return number ns nanoseconds per call
+--- @return number bps bytes per second
+--- @return number alloc kilobytes allocated per call
+--- @return table? stats allocation statistics per call
+local function measure(fn, w)
+    local fmt = w.fmt
+    local niter = math.ceil(w.niter * scale)
+    local nbyte = #fn(fmt, unpack(w.args))
+
+    -- warm up
+    for _ = 1, niter / 10 do
+        fn(fmt, unpack(w.args))
+    end
+
+    -- measure the allocated memory without collecting garbage
+    collectgarbage('collect')
+    collectgarbage('stop')
+    local mem = collectgarbage('count')
+    local n = math.min(niter, 1000)
+    for _ = 1, n do
+        fn(fmt, unpack(w.args))
+    end
+    local alloc = (collectgarbage('count') - mem) / n
+    collectgarbage('restart')
+
+    -- count the allocations
+    local stats
+    if format.alloc_reset then
+        format.alloc_reset()
+        for _ = 1, n do
+            fn(fmt, unpack(w.args))
+        end
+        stats = format.alloc_stats()
+        stats.count = (stats.lua.count + stats.malloc.count) / n
+        stats.bytes = (stats.lua.bytes + stats.malloc.bytes) / n
+        for _, v in pairs(stats.specs) do
+            v.count = v.count / n
+            v.bytes = v.bytes / n
+        end
+    end
+
+    local t = gettime()
+    for _ = 1, niter do
+        fn(fmt, unpack(w.args))
+    end
+    t = gettime() - t
+    return t / niter * 1e9, nbyte * niter / t, alloc, stats
+end
+
+print(string.format('%-12s %-14s %12s %12s %12s', 'workload', 'function',
+                    'ns/call', 'MB/s', 'alloc KB'))
+for _, w in ipairs(WORKLOADS) do
+    for _, v in ipairs({
+        {
+            'format',
+            format,
+        },
+        {
+            'string.format',
+            w.std or string.format,
+        },
+    }) do
+        local ns, bps, alloc, stats = measure(v[2], w)
+        local line = string.format('%-12s %-14s %12.1f %12.1f %12.3f', w.name,
+                                   v[1], ns, bps / 1024 / 1024, alloc)
+        if stats then
+            line = line .. string.format('  allocs/call: %.2f (%.0f bytes)',
+                                         stats.count, stats.bytes)
+            if v[2] == format then
+                local specs = {}
+                for k, st in pairs(stats.specs) do
+                    specs[#specs + 1] = string.format('%%%s: %.2f (%.0f)', k,
+                                                      st.count, st.bytes)
+                end
+                table.sort(specs)
+                line = line .. ' ' .. table.concat(specs, ' ')
+            end
+        end
+        print(line)
+    end
+end
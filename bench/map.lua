@@ -0,0 +1,70 @@
+--
+-- benchmark of format.map compared with a Lua loop over format()
+--
+-- usage: lua bench/map.lua [rows] [iterations]
+--
+local format = require('string.format')
+local gettime = require('time.clock').gettime
+local unpack = unpack or table.unpack
+local nrow = tonumber(arg[1]) or 10000
+local niter = tonumber(arg[2]) or 20
+
+local FMT = '%d,%s,%.2f,%q'
+local ROWS = {}
+for i = 1, nrow do
+    ROWS[i] = {
+        i,
+        'user' .. i,
+        i / 7,
+        'note "' .. i .. '"',
+    }
+end
+
+--- measure the time of fn() in nanoseconds per row
+--- @param fn function
+--- @return number
+local function measure(fn)
+    -- warm up
+    fn()
+    local t = gettime()
+    for _ = 1, niter do
+        fn()
+    end
+    t = gettime() - t
+    return t / niter / nrow * 1e9
+end
+
+for _, v in ipairs({
+    {
+        name = 'array',
+        loop = function()
+            local res = {}
+            for i, row in ipairs(ROWS) do
+                res[i] = format(FMT, unpack(row))
+            end
+            return res
+        end,
+        map = function()
+            return format.map(FMT, ROWS)
+        end,
+    },
+    {
+        name = 'joined',
+        loop = function()
+            local res = {}
+            for i, row in ipairs(ROWS) do
+                res[i] = format(FMT, unpack(row))
+            end
+            return table.concat(res, '\n')
+        end,
+        map = function()
+            return format.map(FMT, ROWS, '\n')
+        end,
+    },
+}) do
+    local loop = measure(v.loop)
+    local map = measure(v.map)
+    print(string.format(
+              '%-8s %8d rows  loop: %8.1f ns/row  map: %8.1f ns/row  (x%.2f)',
+              v.name, nrow, loop, map, loop / map))
+end
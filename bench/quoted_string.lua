@@ -0,0 +1,68 @@
+--
+-- benchmark of the %q specifier on ASCII, mixed and invalid-heavy payloads
+--
+-- usage: lua bench/quoted_string.lua [size] [iterations]
+--
+local format = require('string.format')
+local gettime = require('time.clock').gettime
+local size = tonumber(arg[1]) or 16 * 1024
+local niter = tonumber(arg[2]) or 2000
+
+--- build a payload of the given size by repeating the record
+--- @param rec string
+--- @return string
+local function payload(rec)
+    local n = math.ceil(size / #rec)
+    return string.sub(string.rep(rec, n), 1, size)
+end
+
+--- measure the throughput of fn(fmt, s) in MB/s
+--- @param fn function
+--- @param s string
+--- @return number
+local function measure(fn, s)
+    -- warm up
+    for _ = 1, 10 do
+        fn('%q', s)
+    end
+    local t = gettime()
+    for _ = 1, niter do
+        fn('%q', s)
+    end
+    t = gettime() - t
+    return #s * niter / t / 1024 / 1024
+end
+
+for _, v in ipairs({
+    {
+        name = 'json',
+        data = payload(
+            '{"id": 12345, "name": "example user", "tags": ["alpha", "beta"], ' ..
+                '"note": "lorem ipsum dolor sit amet"},'),
+    },
+    {
+        name = 'text',
+        data = payload(
+            'GET /api/v1/users/12345/profile?fields=name,email HTTP/1.1 200 ' ..
+                '1532 Mozilla/5.0 (X11; Linux x86_64) '),
+    },
+    {
+        name = 'multiline',
+        data = payload('lorem ipsum dolor sit amet, consectetur adipiscing\n'),
+    },
+    {
+        name = 'mixed',
+        data = payload('日本語のテキストと English text が混ざった文章です。'),
+    },
+    {
+        name = 'invalid',
+        data = payload('abc' .. string.char(0xFF) .. 'def' ..
+                           string.char(0xE3, 0x81) .. 'ghi' ..
+                           string.char(0xC0, 0x80) .. 'jk'),
+    },
+}) do
+    print(string.format(
+              '%-10s %8d bytes  format: %9.1f MB/s  string.format: %9.1f MB/s',
+              v.name, #v.data, measure(format, v.data),
+              measure(string.format, v.data)))
+end
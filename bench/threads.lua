@@ -0,0 +1,65 @@
+--
+-- benchmark of the parallel batch formatting by the number of threads
+--
+-- usage: lua bench/threads.lua [rows] [max-threads] [iterations]
+--
+local format = require('string.format')
+local gettime = require('time.clock').gettime
+local nrow = tonumber(arg[1]) or 1000000
+local maxthread = tonumber(arg[2]) or 8
+local niter = tonumber(arg[3]) or 5
+
+local FMT = '%d,%s,%.3f,%g,%q'
+local IDS = {}
+local NAMES = {}
+local VALUES = {}
+local RATIOS = {}
+local NOTES = {}
+local ROWS = {}
+for i = 1, nrow do
+    IDS[i] = i
+    NAMES[i] = 'user' .. i
+    VALUES[i] = i / 7
+    RATIOS[i] = i * 1.1e-3
+    NOTES[i] = 'note "' .. i .. '"'
+    ROWS[i] = {
+        IDS[i],
+        NAMES[i],
+        VALUES[i],
+        RATIOS[i],
+        NOTES[i],
+    }
+end
+
+--- measure the time of fn() in nanoseconds per row
+--- @param fn function
+--- @return number
+local function measure(fn)
+    -- warm up
+    fn()
+    local t = gettime()
+    for _ = 1, niter do
+        fn()
+    end
+    t = gettime() - t
+    return t / niter / nrow * 1e9
+end
+
+local base = {}
+local nthread = 1
+while nthread <= maxthread do
+    format.threads(nthread)
+    local map = measure(function()
+        return format.map(FMT, ROWS, '\n')
+    end)
+    local columns = measure(function()
+        return format.columns(FMT, IDS, NAMES, VALUES, RATIOS, NOTES, nrow)
+    end)
+    base.map = base.map or map
+    base.columns = base.columns or columns
+    print(string.format(
+              'threads: %3d  map: %8.1f ns/row (x%.2f)  columns: %8.1f ns/row (x%.2f)',
+              nthread, map, base.map / map, columns, base.columns / columns))
+    nthread = nthread * 2
+end
+format.threads(1)
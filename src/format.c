@@ -21,172 +21,514 @@
  *
  */
 
+#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 // lua
 #include <lauxlib.h>
 #include <lua.h>
+// float conversion
+#include "fpconv.h"
 
-static int push_string(lua_State *L)
-{
-    char *str = (char *)lua_topointer(L, 1);
-    lua_pushstring(L, str);
-    return 1;
-}
+#ifndef LUA_FILEHANDLE
+// lua 5.1 defines it in lualib.h
+# define LUA_FILEHANDLE "FILE*"
+#endif
+
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
 
+#if LUA_VERSION_NUM < 502
+# define lua_rawlen(L, idx) lua_objlen((L), (idx))
+#endif
+
+#ifdef STRING_FORMAT_ALLOC_STATS
 /**
- * @brief is_utf8firstb determines whether b is the first byte of UTF-8
- * @param b byte to be checked whether it is the first byte of UTF-8 or not.
- * @return int 1 if b is the first byte of UTF-8, otherwise 0.
+ * @brief fmt_alloc_stat_t is the number and the total size of allocations.
  */
-static int is_utf8firstb(unsigned char b)
+typedef struct {
+    size_t count;
+    size_t bytes;
+} fmt_alloc_stat_t;
+
+// allocations by lua_Alloc and by malloc of this module
+static fmt_alloc_stat_t alloc_lua;
+static fmt_alloc_stat_t alloc_malloc;
+// allocations while converting each conversion type
+static fmt_alloc_stat_t alloc_specs[128];
+// conversion type being converted by the current thread, or 0
+static __thread unsigned char alloc_spec;
+
+static inline void alloc_count(fmt_alloc_stat_t *stat, size_t n)
 {
-    switch (b) {
-    case 0x00 ... 0x7F:
-    case 0xC2 ... 0xDF:
-    case 0xE0 ... 0xEF:
-    case 0xF0 ... 0xF4:
-        return 1;
-    default:
-        return 0;
+    __atomic_fetch_add(&stat->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat->bytes, n, __ATOMIC_RELAXED);
+    if (alloc_spec) {
+        stat = alloc_specs + alloc_spec;
+        __atomic_fetch_add(&stat->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stat->bytes, n, __ATOMIC_RELAXED);
     }
 }
 
+static void *alloc_hook_malloc(size_t n)
+{
+    alloc_count(&alloc_malloc, n);
+    return malloc(n);
+}
+
+static void *alloc_hook_realloc(void *ptr, size_t n)
+{
+    alloc_count(&alloc_malloc, n);
+    return realloc(ptr, n);
+}
+
+// count the allocations of this module without LD_PRELOAD
+# define malloc(n)       alloc_hook_malloc(n)
+# define realloc(ptr, n) alloc_hook_realloc((ptr), (n))
+# define ALLOC_SPEC(type) (alloc_spec = (unsigned char)(type))
+#else
+# define ALLOC_SPEC(type) ((void)0)
+#endif
+
+//
+// The Unicode Standard
+// Version 15.0 – Core Specification
+//
+// Chapter 3
+//  Conformance
+// https://www.unicode.org/versions/Unicode15.0.0/ch03.pdf
+//
+// Table 3-7. Well-Formed UTF-8 Byte Sequences
+//
+//  Code Points        | 1st Byte | 2nd Byte | 3rd Byte | 4th Byte
+//  U+0000..U+007F     | 00..7F   |          |          |
+//  U+0080..U+07FF     | C2..DF   | 80..BF   |          |
+//  U+0800..U+0FFF     | E0       | A0..BF   | 80..BF   |
+//  U+1000..U+CFFF     | E1..EC   | 80..BF   | 80..BF   |
+//  U+D000..U+D7FF     | ED       | 80..9F   | 80..BF   |
+//  U+E000..U+FFFF     | EE..EF   | 80..BF   | 80..BF   |
+//  U+10000..U+3FFFF   | F0       | 90..BF   | 80..BF   | 80..BF
+//  U+40000..U+FFFFF   | F1..F3   | 80..BF   | 80..BF   | 80..BF
+//  U+100000..U+10FFFF | F4       | 80..8F   | 80..BF   | 80..BF
+//
+
+// byte classes of UTF-8
+enum {
+    U8C_ASCII = 0, // 00-7F
+    U8C_T80,       // 80-8F
+    U8C_T90,       // 90-9F
+    U8C_TA0,       // A0-BF
+    U8C_ILL,       // C0-C1, F5-FF
+    U8C_L2,        // C2-DF
+    U8C_E0,        // E0
+    U8C_L3,        // E1-EC, EE-EF
+    U8C_ED,        // ED
+    U8C_F0,        // F0
+    U8C_L4,        // F1-F3
+    U8C_F4,        // F4
+    U8C_NUM
+};
+
+static const unsigned char UTF8_CLASS[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00-0F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 10-1F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20-2F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 30-3F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 40-4F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 50-5F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60-6F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70-7F
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80-8F
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 90-9F
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // A0-AF
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // B0-BF
+    4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // C0-CF
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // D0-DF
+    6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 7, // E0-EF
+    9, 10, 10, 10, 11, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // F0-FF
+};
+
+// states of the UTF-8 decoder
+enum {
+    U8S_ACCEPT = 0, // valid sequence
+    U8S_INVALID,    // invalid sequence, but no first byte has been seen yet
+    U8S_STOP,       // first byte of the next character is found
+    U8S_T1,         // 1 more tail byte (80-BF) is expected
+    U8S_T2,         // 2 more tail bytes are expected
+    U8S_T3,         // 3 more tail bytes are expected
+    U8S_E0,         // A0-BF and 1 more tail byte are expected
+    U8S_ED,         // 80-9F and 1 more tail byte are expected
+    U8S_F0,         // 90-BF and 2 more tail bytes are expected
+    U8S_F4,         // 80-8F and 2 more tail bytes are expected
+    U8S_NUM
+};
+
+// length of the sequence for each class of the first byte.
+// the length 0 means that the byte cannot be the first byte of a sequence.
+static const unsigned char UTF8_LENGTH[U8C_NUM] = {
+    1, 0, 0, 0, 0, 2, 3, 3, 3, 4, 4, 4,
+};
+
+#define XX U8S_STOP
+#define IV U8S_INVALID
+#define OK U8S_ACCEPT
+#define T1 U8S_T1
+#define T2 U8S_T2
+
+// state transitions for each byte class.
+// in the U8S_ACCEPT state the byte is the first byte of a multibyte sequence,
+// and in the other states any first byte of a character (00-7F, C2-F4) stops
+// the sequence.
+static const unsigned char UTF8_TRANS[U8S_NUM][U8C_NUM] = {
+    // ASC 80  90  A0  ILL L2  E0      L3  ED      F0      L4      F4
+    {XX, XX, XX, XX, XX, T1, U8S_E0, T2, U8S_ED, U8S_F0, U8S_T3, U8S_F4},
+    {XX, IV, IV, IV, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_INVALID
+    {XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX}, // U8S_STOP
+    {XX, OK, OK, OK, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_T1
+    {XX, T1, T1, T1, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_T2
+    {XX, T2, T2, T2, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_T3
+    {XX, IV, IV, T1, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_E0
+    {XX, T1, T1, IV, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_ED
+    {XX, IV, T2, T2, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_F0
+    {XX, T2, IV, IV, IV, XX, XX, XX, XX, XX, XX, XX}, // U8S_F4
+};
+
+#undef XX
+#undef IV
+#undef OK
+#undef T1
+#undef T2
+
 /**
  * @brief utf8len determines the length of UTF-8 character pointed to by s.
  * @param s pointer to UTF-8 character sequence to be checked. s must be NULL
  * terminated.
  * @return int length of UTF-8 character pointed to by s. If s does not point to
- * a valid UTF-8 character, it returns a negative length.
- */
-static int utf8len(unsigned char *s)
-{
-    //
-    // The Unicode Standard
-    // Version 15.0 – Core Specification
-    //
-    // Chapter 3
-    //  Conformance
-    // https://www.unicode.org/versions/Unicode15.0.0/ch03.pdf
-    //
-    // Table 3-7. Well-Formed UTF-8 Byte Sequences
-    //
-    // illegal byte sequence will be replaced with U+FFFD ("\xEF\xBF\xBD")
-    //
-#define is_utf8tail(c) (((c) & 0xC0) == 0x80)
-
-    switch (*s) {
-    case 0x00 ... 0x7F:
-        // 1 byte: 00-7F
-        return 1;
-
-    case 0x80 ... 0xBF:
-    case 0xC0 ... 0xC1:
-        // illegal 1 byte sequence
-        return -1;
+ * a valid UTF-8 character, it returns a negative length of the illegal byte
+ * sequence that ends before the first byte of the next character (00-7F,
+ * C2-F4) or at the end of the expected sequence. illegal byte sequence will be
+ * replaced with U+FFFD ("\xEF\xBF\xBD").
+ */
+static int utf8len(const unsigned char *s)
+{
+    int cls   = UTF8_CLASS[*s];
+    int n     = UTF8_LENGTH[cls];
+    int state = UTF8_TRANS[U8S_ACCEPT][cls];
+    int i     = 1;
 
-    case 0xC2 ... 0xDF:
-        // 2 byte: C2-DF 80-BF
-        if (is_utf8tail(s[1])) {
-            return 2;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
+    if (n < 2) {
+        // 1 byte: 00-7F, or illegal first byte: 80-C1, F5-FF
+        return n ? 1 : -1;
+    }
+    for (; i < n; i++) {
+        state = UTF8_TRANS[state][UTF8_CLASS[s[i]]];
+        if (state == U8S_STOP) {
+            return -i;
         }
-        return -2;
+    }
+    return state == U8S_ACCEPT ? n : -n;
+}
 
-    case 0xE0:
-        // 3 byte: E0 A0-BF 80-BF
-        if (s[1] >= 0xA0 && s[1] <= 0xBF && is_utf8tail(s[2])) {
-            return 3;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
-        }
-        return -3;
+/**
+ * @brief utf8span returns the length of the initial segment of s that
+ * consists of valid multibyte UTF-8 characters only.
+ * the length of each character is taken from its first byte, and the
+ * following bytes are validated by the state transitions, so the loop only
+ * branches on the result of each character.
+ */
+static size_t utf8span(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
 
-    case 0xE1 ... 0xEC:
-        // 3 byte: E1-EC 2(80-BF)
-        if (is_utf8tail(s[1]) && is_utf8tail(s[2])) {
-            return 3;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
-        }
-        return -3;
+    while (i < len) {
+        int cls   = UTF8_CLASS[s[i]];
+        size_t n  = UTF8_LENGTH[cls];
+        int state = UTF8_TRANS[U8S_ACCEPT][cls];
+        size_t k  = 1;
 
-    case 0xED:
-        // 3 byte: ED 80-9F 80-BF
-        if (s[1] >= 0x80 && s[1] <= 0x9F && is_utf8tail(s[2])) {
-            return 3;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
+        if (n < 2 || n > len - i) {
+            // 00-7F, illegal first byte or truncated sequence
+            break;
         }
-        return -3;
-
-    case 0xEE ... 0xEF:
-        // 3 byte: EE-EF 2(80-BF)
-        if (is_utf8tail(s[1]) && is_utf8tail(s[2])) {
-            return 3;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
+        for (; k < n; k++) {
+            state = UTF8_TRANS[state][UTF8_CLASS[s[i + k]]];
+        }
+        if (state != U8S_ACCEPT) {
+            break;
         }
-        return -3;
+        i += n;
+    }
+    return i;
+}
 
-    case 0xF0:
-        // 4 byte: F0 90-BF 2(80-BF)
-        if (s[1] >= 0x90 && s[1] <= 0xBF && is_utf8tail(s[2]) &&
-            is_utf8tail(s[3])) {
-            return 4;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
-        } else if (is_utf8firstb(s[3])) {
-            return -3;
-        }
-        return -4;
-
-    case 0xF1 ... 0xF3:
-        // 4 byte: F1-F3 3(80-BF)
-        if (is_utf8tail(s[1]) && is_utf8tail(s[2]) && is_utf8tail(s[3])) {
-            return 4;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
-        } else if (is_utf8firstb(s[3])) {
-            return -3;
-        }
-        return -4;
-
-    case 0xF4:
-        // 4 byte: F4 80-8F 2(80-BF)
-        if (s[1] >= 0x80 && s[1] <= 0x8F && is_utf8tail(s[2]) &&
-            is_utf8tail(s[3])) {
-            return 4;
-        } else if (is_utf8firstb(s[1])) {
-            return -1;
-        } else if (is_utf8firstb(s[2])) {
-            return -2;
-        } else if (is_utf8firstb(s[3])) {
-            return -3;
+#define FMT_BUFFER_SIZE 512
+
+/**
+ * @brief fmt_strbuf_t is the growable byte buffer returned by format.buffer.
+ * the memory is allocated by malloc and released by __gc.
+ */
+typedef struct {
+    char *mem;  // memory of the buffer
+    size_t len; // length of the content
+    size_t cap; // capacity of the memory
+} fmt_strbuf_t;
+
+#define FMT_STRBUF_MT "string.format.buffer"
+
+/**
+ * @brief fmt_buf_t is the output buffer of the formatted string.
+ * the buffer uses the initial memory embedded in itself at first, and then
+ * it uses the memory of userdata that is placed at the reserved stack slot
+ * when it grows. so the memory is never leaked on error.
+ * if the buffer is attached to the fmt_strbuf_t, it appends to the memory of
+ * the fmt_strbuf_t instead.
+ */
+typedef struct {
+    lua_State *L;
+    int idx;           // stack slot that holds the userdata memory
+    char *mem;         // memory of the buffer
+    size_t len;        // length of the content
+    size_t cap;        // capacity of the memory
+    fmt_strbuf_t *ext; // attached buffer or NULL
+    char init[FMT_BUFFER_SIZE];
+} fmt_buf_t;
+
+/**
+ * @brief buf_init initializes the buffer and reserves a stack slot at the top
+ * of the stack for its memory.
+ */
+static inline void buf_init(lua_State *L, fmt_buf_t *b)
+{
+    ALLOC_SPEC(0);
+    lua_pushnil(L);
+    b->L   = L;
+    b->idx = lua_gettop(L);
+    b->mem = b->init;
+    b->len = 0;
+    b->cap = sizeof(b->init);
+    b->ext = NULL;
+}
+
+/**
+ * @brief buf_attach initializes the buffer to append to the memory of the
+ * fmt_strbuf_t. the length of the fmt_strbuf_t is not changed until
+ * buf_detach is called, so the content appended by the failed conversion is
+ * discarded.
+ */
+static inline void buf_attach(lua_State *L, fmt_buf_t *b, fmt_strbuf_t *ext)
+{
+    b->L   = L;
+    b->idx = 0;
+    b->mem = ext->mem;
+    b->len = ext->len;
+    b->cap = ext->cap;
+    b->ext = ext;
+}
+
+static inline void buf_detach(fmt_buf_t *b)
+{
+    b->ext->len = b->len;
+}
+
+static char *buf_grow(fmt_buf_t *b, size_t n)
+{
+    size_t cap = b->cap * 2;
+    char *mem  = NULL;
+
+    // the buffer of the worker thread has no lua state to raise the error,
+    // so batch_worker reserves the memory for each row before converting it
+    assert(b->L != NULL);
+    if (n > SIZE_MAX / 2 - b->len) {
+        luaL_error(b->L, "formatted string too large");
+    } else if (cap < b->len + n) {
+        cap = b->len + n;
+    }
+
+    if (b->ext) {
+        mem = realloc(b->mem, cap);
+        if (!mem) {
+            luaL_error(b->L, "failed to grow buffer: %s", strerror(errno));
         }
-        return -4;
+        b->ext->mem = mem;
+        b->ext->cap = cap;
+        b->mem      = mem;
+        b->cap      = cap;
+        return mem + b->len;
+    }
 
-#undef is_utf8tail
+    mem = lua_newuserdata(b->L, cap);
+    memcpy(mem, b->mem, b->len);
+    // release the previous memory
+    lua_replace(b->L, b->idx);
+    b->mem = mem;
+    b->cap = cap;
 
-    default:
-        // illegal byte sequence: F5-FF
-        return -1;
+    return mem + b->len;
+}
+
+/**
+ * @brief buf_reserve ensures that the buffer can store n more bytes.
+ * @return char* pointer to the end of the content.
+ */
+static inline char *buf_reserve(fmt_buf_t *b, size_t n)
+{
+    if (b->cap - b->len < n) {
+        return buf_grow(b, n);
+    }
+    return b->mem + b->len;
+}
+
+static inline void buf_add(fmt_buf_t *b, const char *s, size_t n)
+{
+    if (n) {
+        memcpy(buf_reserve(b, n), s, n);
+        b->len += n;
+    }
+}
+
+static inline void buf_addchar(fmt_buf_t *b, char c)
+{
+    *buf_reserve(b, 1) = c;
+    b->len++;
+}
+
+/**
+ * @brief buf_addf appends the string formatted by vsnprintf to the buffer.
+ * the string is written directly to the buffer memory, so no temporary memory
+ * is allocated.
+ */
+static void buf_addf(fmt_buf_t *b, const char *fmt, ...)
+{
+    size_t avail = b->cap - b->len;
+    va_list args;
+    int n = 0;
+
+    va_start(args, fmt);
+    n = vsnprintf(b->mem + b->len, avail, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        luaL_error(b->L, "failed to vsnprintf: %s", strerror(errno));
+    } else if ((size_t)n >= avail) {
+        // grow the buffer to store the result and terminating null byte
+        va_start(args, fmt);
+        n = vsnprintf(buf_reserve(b, (size_t)n + 1), (size_t)n + 1, fmt, args);
+        va_end(args);
+    }
+    b->len += n;
+}
+
+/**
+ * @brief buf_pushresult pushes the content as a string to the reserved stack
+ * slot.
+ */
+static inline void buf_pushresult(fmt_buf_t *b)
+{
+    lua_pushlstring(b->L, b->mem, b->len);
+    lua_replace(b->L, b->idx);
+}
+
+/**
+ * @brief fmt_rowpos_t is the position of the row converted by the batch API.
+ * the errors of the arguments of the row are reported with it.
+ */
+typedef struct {
+    int row;     // index of the row
+    int base;    // stack index of the value placed before the row arguments
+    int columns; // non-zero if the arguments of the row are the columns
+} fmt_rowpos_t;
+
+/**
+ * @brief argerror raises the error of the argument at idx. if pos is not
+ * NULL, the error is reported with the index of the row and the position of
+ * the argument in the row as the error of the rows argument, or with the
+ * index of the row as the error of the column argument.
+ */
+static int argerror(lua_State *L, const fmt_rowpos_t *pos, int idx,
+                    const char *msg)
+{
+    if (!pos) {
+        return luaL_argerror(L, idx, msg);
+    } else if (pos->columns) {
+        return luaL_argerror(L, idx - pos->base + 1,
+                             lua_pushfstring(L, "row %d: %s", pos->row, msg));
+    }
+    return luaL_argerror(L, 2,
+                         lua_pushfstring(L, "row %d, argument %d: %s", pos->row,
+                                         idx - pos->base, msg));
+}
+
+static int typeerror(lua_State *L, const fmt_rowpos_t *pos, int idx,
+                     const char *tname)
+{
+    return argerror(L, pos, idx,
+                    lua_pushfstring(L, "%s expected, got %s", tname,
+                                    luaL_typename(L, idx)));
+}
+
+/**
+ * @brief rowerror raises the error that is not of a single argument. if pos
+ * is not NULL, the error is reported with the index of the row.
+ */
+static int rowerror(lua_State *L, const fmt_rowpos_t *pos, const char *msg)
+{
+    if (!pos) {
+        return luaL_error(L, "%s", msg);
+    } else if (pos->columns) {
+        return luaL_error(L, "row %d: %s", pos->row, msg);
+    }
+    return luaL_argerror(L, 2, lua_pushfstring(L, "row %d: %s", pos->row, msg));
+}
+
+/**
+ * @brief checknumarg works the same as luaL_checknumber but reports the
+ * error with the position of the row.
+ */
+static inline lua_Number checknumarg(lua_State *L, const fmt_rowpos_t *pos,
+                                     int idx)
+{
+    if (pos && !lua_isnumber(L, idx)) {
+        typeerror(L, pos, idx, "number");
+    }
+    return luaL_checknumber(L, idx);
+}
+
+/**
+ * @brief checkintegerarg works the same as luaL_checkinteger but reports the
+ * error with the position of the row.
+ */
+static inline lua_Integer checkintegerarg(lua_State *L,
+                                          const fmt_rowpos_t *pos, int idx)
+{
+    if (pos) {
+#if LUA_VERSION_NUM >= 503
+        int isint = 0;
+
+        lua_tointegerx(L, idx, &isint);
+        if (!isint && lua_isnumber(L, idx)) {
+            argerror(L, pos, idx, "number has no integer representation");
+        }
+#endif
+        if (!lua_isnumber(L, idx)) {
+            typeerror(L, pos, idx, "number");
+        }
     }
+    return luaL_checkinteger(L, idx);
 }
 
 static const char *tolstring(lua_State *L, int idx, size_t *len)
@@ -232,393 +574,3754 @@ static const char *tolstring(lua_State *L, int idx, size_t *len)
     return lua_tolstring(L, -1, len);
 }
 
-static void push_quoted_string(lua_State *L, int arg_idx)
+/**
+ * @brief add_lstring appends the string to the buffer. embedded null bytes
+ * are preserved.
+ * @param width minimum field width, or negative if not specified.
+ * @param prec maximum number of bytes to be written, or negative if not
+ * specified.
+ * @param left pad on the right instead of the left if non-zero.
+ */
+static void add_lstring(fmt_buf_t *b, const char *s, size_t len, int width,
+                        int prec, int left)
 {
-    int top          = lua_gettop(L);
-    size_t len       = 0;
-    unsigned char *s = (unsigned char *)tolstring(L, arg_idx, &len);
-    luaL_Buffer b    = {};
+    size_t pad = 0;
+    char *p    = NULL;
+
+    if (prec >= 0 && (size_t)prec < len) {
+        len = (size_t)prec;
+    }
+    if (width > 0 && (size_t)width > len) {
+        pad = (size_t)width - len;
+    }
+
+    if (!pad) {
+        buf_add(b, s, len);
+    } else {
+        p = buf_reserve(b, len + pad);
+        if (left) {
+            memcpy(p, s, len);
+            memset(p + len, ' ', pad);
+        } else {
+            memset(p, ' ', pad);
+            memcpy(p + pad, s, len);
+        }
+        b->len += len + pad;
+    }
+}
+
+/**
+ * @brief add_string appends the string representation of the argument to the
+ * buffer.
+ */
+static void add_string(lua_State *L, fmt_buf_t *b, int arg_idx, int width,
+                       int prec, int left)
+{
+    size_t len = 0;
+
+    if (lua_type(L, arg_idx) == LUA_TSTRING) {
+        // use the bytes of the string argument directly
+        const char *s = lua_tolstring(L, arg_idx, &len);
+        add_lstring(b, s, len, width, prec, left);
+    } else {
+        const char *s = tolstring(L, arg_idx, &len);
+        add_lstring(b, s, len, width, prec, left);
+        lua_pop(L, 1);
+    }
+}
+
+#define SWAR_ONES  ((uint64_t)0x0101010101010101)
+#define SWAR_HIGHS ((uint64_t)0x8080808080808080)
+// sets the high bit of the bytes of x that are less than n (n <= 0x80).
+// the result is non-zero if and only if any byte is less than n.
+#define SWAR_LESS(x, n) (((x) - SWAR_ONES * (n)) & ~(x) & SWAR_HIGHS)
+
+/**
+ * @brief quoted_span returns the length of the initial segment of s that can
+ * be copied to the quoted string as is. the bytes that need attention are
+ * '"', '\\', control characters and non-ASCII bytes.
+ * the segment is scanned 32 or 16 bytes at a time if AVX2 or SSE2 is
+ * available, and 8 bytes at a time with the word-sized operations otherwise.
+ */
+static inline size_t quoted_span(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    {
+        const __m256i sp  = _mm256_set1_epi8(0x20);
+        const __m256i dq  = _mm256_set1_epi8('"');
+        const __m256i bs  = _mm256_set1_epi8('\\');
+        const __m256i del = _mm256_set1_epi8(0x7F);
+        for (; len - i >= 32; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+            // bytes greater than 0x7F are negative in the signed comparison
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi8(sp, v),
+                                _mm256_cmpeq_epi8(v, del)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, dq),
+                                _mm256_cmpeq_epi8(v, bs)));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+            if (mask) {
+                return i + (size_t)__builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i sp  = _mm_set1_epi8(0x20);
+        const __m128i dq  = _mm_set1_epi8('"');
+        const __m128i bs  = _mm_set1_epi8('\\');
+        const __m128i del = _mm_set1_epi8(0x7F);
+        for (; len - i >= 16; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            // bytes greater than 0x7F are negative in the signed comparison
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi8(v, sp), _mm_cmpeq_epi8(v, del)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)));
+            unsigned mask = (unsigned)_mm_movemask_epi8(m);
+            if (mask) {
+                return i + (size_t)__builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+
+    // check 8 bytes at a time on any platform
+    for (; len - i >= 8; i += 8) {
+        uint64_t w = 0;
+        memcpy(&w, s + i, 8);
+        if ((w & SWAR_HIGHS) | SWAR_LESS(w, 0x20) |
+            SWAR_LESS(w ^ (SWAR_ONES * '"'), 1) |
+            SWAR_LESS(w ^ (SWAR_ONES * '\\'), 1) |
+            SWAR_LESS(w ^ (SWAR_ONES * 0x7F), 1)) {
+            // find the byte in the following loop
+            break;
+        }
+    }
+
+    for (; i < len; i++) {
+        unsigned char c = s[i];
+        if (c < 0x20 || c > 0x7E || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
 
-    luaL_buffinit(L, &b);
-    luaL_addchar(&b, '"');
+/**
+ * @brief add_quoted appends the string to the buffer as the quoted string.
+ */
+static void add_quoted(fmt_buf_t *b, const unsigned char *s, size_t len)
+{
+    // the quoted string is at least as long as the source string in most
+    // cases, so reserve the memory at once
+    buf_reserve(b, len + 2);
+    buf_addchar(b, '"');
     while (len > 0) {
-        int nbyte = utf8len(s);
+        // copy the run of bytes that need no escaping at once
+        size_t span = quoted_span(s, len);
+        int nbyte   = 0;
+        if (span) {
+            buf_add(b, (char *)s, span);
+            s += span;
+            len -= span;
+            if (!len) {
+                break;
+            }
+        }
+
+        if (*s >= 0x80) {
+            // copy the run of valid multibyte characters at once
+            span = utf8span(s, len);
+            if (span) {
+                buf_add(b, (char *)s, span);
+                s += span;
+                len -= span;
+                continue;
+            }
+        }
+
+        nbyte = utf8len(s);
         if (nbyte < 0) {
             // invalid utf8 byte sequences will be replaced with U+FFFD
-            luaL_addlstring(&b, "\xEF\xBF\xBD", 3);
+            buf_add(b, "\xEF\xBF\xBD", 3);
             nbyte = -nbyte;
             // skip invalid utf8 byte sequences
             s += nbyte;
             len -= nbyte;
             continue;
-        } else if (nbyte > 1) {
-            // copy utf8 byte sequences
-            luaL_addlstring(&b, (char *)s, nbyte);
-            s += nbyte;
-            len -= nbyte;
-            continue;
         }
         len--;
 
         if (*s == '"' || *s == '\\') {
-            luaL_addchar(&b, '\\');
-            luaL_addchar(&b, *s);
+            buf_addchar(b, '\\');
+            buf_addchar(b, *s);
         } else if (!iscntrl(*s)) {
-            luaL_addchar(&b, *s);
+            buf_addchar(b, *s);
         } else {
             switch (*s) {
             case 0:
-                luaL_addstring(&b, "\\0");
+                buf_add(b, "\\0", 2);
                 break;
             case 7:
-                luaL_addstring(&b, "\\a");
+                buf_add(b, "\\a", 2);
                 break;
             case 8:
-                luaL_addstring(&b, "\\b");
+                buf_add(b, "\\b", 2);
                 break;
             case 9:
-                luaL_addstring(&b, "\\t");
+                buf_add(b, "\\t", 2);
                 break;
             case 10:
-                luaL_addstring(&b, "\\n");
+                buf_add(b, "\\n", 2);
                 break;
             case 11:
-                luaL_addstring(&b, "\\v");
+                buf_add(b, "\\v", 2);
                 break;
             case 12:
-                luaL_addstring(&b, "\\f");
+                buf_add(b, "\\f", 2);
                 break;
             case 13:
-                luaL_addstring(&b, "\\r");
+                buf_add(b, "\\r", 2);
                 break;
 
             default: {
                 char buf[10];
+                int n = 0;
                 if (!isdigit(*(s + 1))) {
-                    snprintf(buf, sizeof(buf), "\\%d", (int)*s);
+                    n = snprintf(buf, sizeof(buf), "\\%d", (int)*s);
                 } else {
-                    snprintf(buf, sizeof(buf), "\\%03d", (int)*s);
+                    n = snprintf(buf, sizeof(buf), "\\%03d", (int)*s);
                 }
-                luaL_addstring(&b, buf);
+                buf_add(b, buf, n);
             } break;
             }
         }
         s++;
     }
-    luaL_addchar(&b, '"');
-    luaL_pushresult(&b);
-    lua_replace(L, top + 1);
-    lua_settop(L, top + 1);
-    return;
+    buf_addchar(b, '"');
 }
 
-static void push_format_string(lua_State *L, const char *fmt, int type,
-                               int arg_idx)
+static void add_quoted_string(lua_State *L, fmt_buf_t *b, int arg_idx)
 {
-    union {
-        lua_Integer i;
-        lua_Number d;
-        const char *s;
-        const void *p;
-    } val;
-    char *mem = NULL;
-    int rc    = 0;
+    size_t len    = 0;
+    const char *s = tolstring(L, arg_idx, &len);
 
-    switch (type) {
-    case 'd': // int (decimal)
-    case 'i': // int (decimal) (same as 'd')
-    case 'o': // unsigned int (octal)
-    case 'u': // unsigned int (decimal)
-    case 'x': // unsigned int (hexadecimal)
-    case 'X': // unsigned int (hexadecimal) (uppercase)
-        if (lua_type(L, arg_idx) == LUA_TBOOLEAN) {
-            val.i = lua_toboolean(L, arg_idx);
-        } else {
-            val.i = luaL_checkinteger(L, arg_idx);
+    add_quoted(b, (const unsigned char *)s, len);
+    // remove the string
+    lua_pop(L, 1);
+}
+
+/**
+ * @brief quoted_len returns the length of the string quoted by
+ * add_quoted_string.
+ */
+static size_t quoted_len(const unsigned char *s, size_t len)
+{
+    size_t n = 2;
+
+    while (len > 0) {
+        size_t span = quoted_span(s, len);
+        int nbyte   = 0;
+        n += span;
+        s += span;
+        len -= span;
+        if (!len) {
+            break;
+        }
+
+        if (*s >= 0x80) {
+            span = utf8span(s, len);
+            if (span) {
+                n += span;
+                s += span;
+                len -= span;
+                continue;
+            }
         }
-        if (asprintf(&mem, fmt, val.i) == -1) {
-            luaL_error(L, "failed to asprintf: %s", strerror(errno));
+
+        nbyte = utf8len(s);
+        if (nbyte < 0) {
+            // U+FFFD
+            n += 3;
+            s += -nbyte;
+            len -= -nbyte;
+            continue;
         }
-        break;
+        len--;
 
-    case 'c': // int (character)
+        if (*s == '"' || *s == '\\') {
+            n += 2;
+        } else if (!iscntrl(*s)) {
+            n++;
+        } else {
+            switch (*s) {
+            case 0:
+            case 7 ... 13:
+                n += 2;
+                break;
+            default:
+                if (isdigit(*(s + 1))) {
+                    n += 4;
+                } else {
+                    n += (*s < 10) ? 2 : (*s < 100) ? 3 : 4;
+                }
+            }
+        }
+        s++;
+    }
+    return n;
+}
+
+static void add_format_string(lua_State *L, fmt_buf_t *b,
+                              const fmt_rowpos_t *pos, const char *fmt,
+                              int type, int arg_idx)
+{
+    switch (type) {
+    case 'c': { // int (character)
+        lua_Integer c = 0;
         if (lua_type(L, arg_idx) == LUA_TSTRING) {
             size_t slen   = 0;
             const char *s = lua_tolstring(L, arg_idx, &slen);
             if (slen > 1) {
-                luaL_argerror(L, arg_idx, "string length <=1 expected");
+                argerror(L, pos, arg_idx, "string length <=1 expected");
             }
-            val.i = *s;
+            c = *s;
         } else {
-            val.i = luaL_checkinteger(L, arg_idx);
+            c = checkintegerarg(L, pos, arg_idx);
         }
-        if (asprintf(&mem, fmt, val.i) == -1) {
-            luaL_error(L, "failed to asprintf: %s", strerror(errno));
-        }
-        break;
-
-    case 'e': // double (scientific)
-    case 'E': // double (scientific) (uppercase)
-    case 'f': // double (decimal)
-    case 'F': // double (decimal) (uppercase)
-    case 'g': // double (scientific or decimal)
-    case 'G': // double (scientific or decimal) (uppercase)
-    case 'a': // double (hexadecimal) (C99)
-    case 'A': // double (hexadecimal) (C99) (uppercase)
-        val.d = luaL_checknumber(L, arg_idx);
-        if (asprintf(&mem, fmt, val.d) == -1) {
-            luaL_error(L, "failed to asprintf: %s", strerror(errno));
-        }
-        break;
-
-    case 's': { // any (string)
-        int top = lua_gettop(L);
-        val.s   = tolstring(L, arg_idx, NULL);
-        if (asprintf(&mem, fmt, val.s) == -1) {
-            luaL_error(L, "failed to asprintf: %s", strerror(errno));
-        }
-        lua_settop(L, top);
+        buf_addf(b, fmt, (int)c);
     } break;
 
     case 'p': // void * (pointer)
-        val.p = lua_topointer(L, arg_idx);
-        if (asprintf(&mem, fmt, val.p) == -1) {
-            luaL_error(L, "failed to asprintf: %s", strerror(errno));
-        }
+        buf_addf(b, fmt, lua_topointer(L, arg_idx));
         break;
-
-    case 'q': // any (quoted string)
-        if (fmt[0] != '%' || fmt[1] != 'q' || fmt[2]) {
-            luaL_error(L, "specifier '%%q' cannot have modifiers");
-        }
-        push_quoted_string(L, arg_idx);
-        return;
-    }
-
-    lua_pushcfunction(L, push_string);
-    lua_pushlightuserdata(L, mem);
-    rc = lua_pcall(L, 1, 1, 0);
-    // free allocated string
-    free(mem);
-
-    if (rc != 0) {
-        // rethrow error with error message in stack top
-        lua_error(L);
     }
 }
 
-static inline int uint2str(lua_State *L, char *buf, size_t len,
-                           const char *placeholder, const int narg, int idx)
-{
-    if (idx > narg) {
-        luaL_error(L,
-                   "not enough arguments for placeholder '%s' in format string",
-                   placeholder);
-    }
+#define FMT_FLAG_ALT   0x01 // '#'
+#define FMT_FLAG_ZERO  0x02 // '0'
+#define FMT_FLAG_LEFT  0x04 // '-'
+#define FMT_FLAG_SPACE 0x08 // ' '
+#define FMT_FLAG_PLUS  0x10 // '+'
+#define FMT_FLAG_GROUP 0x20 // '\''
+#define FMT_FLAG_I18N  0x40 // 'I'
 
-    luaL_checktype(L, idx, LUA_TNUMBER);
-    // convert argument to string as integer
-    return snprintf(buf, len, "%d", (int)lua_tonumber(L, idx));
-}
+// width or precision is not specified
+#define FMT_NONE    -1
+// width or precision is specified by the argument ('*')
+#define FMT_DYNAMIC -2
 
 /**
- * @brief format arguments and push them to the stack.
- * - format argments must be placed after format string.
- * - generated strings are pushed to the top of the stack.
- * - you can concat them as follows:
- *
- *   int top = lua_gettop(L);
- *   int lastargs = format_arguments(L, 1); // 1 is index of format string
- *   lua_concat(L, lua_gettop(L) - top); // concat formatted strings
- *
+ * @brief fmt_spec_t describes a literal text followed by a conversion
+ * specification.
+ * the type field is 0 if the segment consists of literal text only.
+ */
+typedef struct {
+    size_t lit;    // offset of the leading literal text
+    size_t litlen; // length of the leading literal text
+    size_t src;    // offset of the placeholder in the format string
+    size_t srclen; // length of the placeholder
+    int flags;     // FMT_FLAG_*
+    int width;     // FMT_NONE, FMT_DYNAMIC or field width
+    int prec;      // FMT_NONE, FMT_DYNAMIC or precision
+    char lenmod;   // length modifier or 0
+    char type;     // conversion type or 0
+} fmt_spec_t;
+
+/**
+ * @brief fmt_compiled_t is the parsed format string.
+ * the spec array is followed by the copy of the format string (srclen + 1
+ * bytes) and the literal text (txtlen bytes) that '%%' are unescaped.
+ */
+typedef struct {
+    size_t nspec;
+    size_t srclen;
+    size_t txtlen;
+    fmt_spec_t spec[];
+} fmt_compiled_t;
+
+#define FMT_COMPILED_SRC(c) ((const char *)((c)->spec + (c)->nspec))
+#define FMT_COMPILED_TXT(c) (FMT_COMPILED_SRC(c) + (c)->srclen + 1)
+
+#define FMT_COMPILED_MT "string.format.compiled"
+
+/**
+ * @brief parse_spec parses the conversion specification pointed to by cur.
  * @param L lua state
- * @param fmt_idx index of format string
- * @return int index of last used argument. if equal to fmt_idx, no argument
- * was used.
+ * @param cur pointer to the '%' character of the placeholder.
+ * @param spec the parsed specification is stored to this.
+ * @return const char* pointer to the next character of the placeholder.
  */
-static int format_arguments(lua_State *L, const int fmt_idx)
+static const char *parse_spec(lua_State *L, const char *cur, fmt_spec_t *spec)
 {
-    const int narg   = lua_gettop(L);
-    const char *fmt  = NULL;
-    const char *head = NULL;
-    const char *cur  = NULL;
-    int nextarg      = fmt_idx;
+    const char *fmt = cur;
 
-    if (lua_type(L, fmt_idx) != LUA_TSTRING) {
-        // ignore non-string format string
-        return 0;
-    }
-    fmt = head = cur = lua_tostring(L, fmt_idx);
+    spec->flags  = 0;
+    spec->width  = FMT_NONE;
+    spec->prec   = FMT_NONE;
+    spec->lenmod = 0;
+    // skip '%'
+    cur++;
 
-    // parse format specifiers
-    while (*cur) {
-        if (*cur == '%') {
-            char buf[255]     = {0};
-            size_t blen       = sizeof(buf);
-            char *placeholder = buf;
+    // flags field
+    for (;; cur++) {
+        switch (*cur) {
+        case '#':
+            spec->flags |= FMT_FLAG_ALT;
+            continue;
+        case '0':
+            spec->flags |= FMT_FLAG_ZERO;
+            continue;
+        case '-':
+            spec->flags |= FMT_FLAG_LEFT;
+            continue;
+        case ' ':
+            spec->flags |= FMT_FLAG_SPACE;
+            continue;
+        case '+':
+            spec->flags |= FMT_FLAG_PLUS;
+            continue;
+        case '\'':
+            spec->flags |= FMT_FLAG_GROUP;
+            continue;
+        case 'I':
+            spec->flags |= FMT_FLAG_I18N;
+            continue;
+        }
+        break;
+    }
 
-#define COPY2PLACEHOLDER(str, len)                                             \
+#define PARSE_DIGITS(field, label)                                             \
     do {                                                                       \
-        size_t slen = (len);                                                   \
-        if (slen >= blen) {                                                    \
-            return luaL_error(L,                                               \
-                              "each placeholder must be less than %d "         \
-                              "characters in format string '%s'",              \
-                              sizeof(placeholder), placeholder);               \
+        if (*cur == '*') {                                                     \
+            (field) = FMT_DYNAMIC;                                             \
+            cur++;                                                             \
+        } else if (isdigit(*cur)) {                                            \
+            (field) = 0;                                                       \
+            for (; isdigit(*cur); cur++) {                                     \
+                if ((field) > (INT_MAX - 9) / 10) {                            \
+                    luaL_error(L, "too large " label " in format string '%s'", \
+                               fmt);                                           \
+                }                                                              \
+                (field) = (field)*10 + (*cur - '0');                           \
+            }                                                                  \
         }                                                                      \
-        blen -= slen;                                                          \
-        memcpy(placeholder, (str), slen);                                      \
-        placeholder += slen;                                                   \
     } while (0)
 
-            if (cur[1] == '%') {
-                lua_pushlstring(L, head, cur - head + 1);
-                // skip '%%' escape sequence
-                cur += 2;
-                head = cur;
-                continue;
-            }
+    // width field
+    PARSE_DIGITS(spec->width, "width");
+    // precision field
+    if (*cur == '.') {
+        // skip '.'
+        cur++;
+        spec->prec = 0;
+        PARSE_DIGITS(spec->prec, "precision");
+    }
 
-            // push leading format string
-            if (cur != head) {
-                lua_pushlstring(L, head, cur - head);
-            }
-            fmt  = cur;
-            head = cur;
-            cur++;
+#undef PARSE_DIGITS
 
-            // flags field
-            while (strchr("#I0- +'", *cur)) {
-                cur++;
-            }
+    // length modifier
+    if (*cur && strchr("hljztL", *cur)) {
+        spec->lenmod = *cur;
+        cur++;
+    }
 
-            // int n_bits = sizeof(int) * 8;
-            // int max_digits = n_bits / 3;
-            // int buffer_size = max_digits + 2 + 1;
-#define DYNSIZE (sizeof(int) * CHAR_BIT / 3 + 3)
-
-            // width field
-            while (strchr("1234567890*", *cur)) {
-                if (*cur == '*') {
-                    int wlen              = DYNSIZE;
-                    const char w[DYNSIZE] = {0};
-
-                    // copy leading format string
-                    COPY2PLACEHOLDER(head, cur - head);
-                    // skip '*'
-                    head = cur + 1;
-
-                    // get width from argument
-                    nextarg++;
-                    wlen = uint2str(L, (char *)w, (size_t)wlen, fmt, narg,
-                                    nextarg);
-                    // copy it to placeholder
-                    COPY2PLACEHOLDER(w, wlen);
-                }
-                cur++;
+    // type field
+    if (!*cur) {
+        luaL_error(L, "missing type field in format string '%s'", fmt);
+    } else if (!strchr("diouxXeEfFgGaAcsrpqm", *cur)) {
+        luaL_error(L,
+                   "unsupported type field at '%c' in "
+                   "format string '%s'",
+                   *cur, fmt);
+    } else if (*cur == 'q' && cur != fmt + 1) {
+        luaL_error(L, "specifier '%%q' cannot have modifiers");
+    } else if (*cur == 'r' && spec->prec != FMT_NONE) {
+        luaL_error(L, "specifier '%%r' cannot have precision");
+    }
+    spec->type = *cur;
+
+    return cur + 1;
+}
+
+/**
+ * @brief build_placeholder rebuilds the placeholder for the printf family
+ * from the specification.
+ * @param buf buffer to store the placeholder. it must be at least
+ * FMT_PLACEHOLDER_SIZE bytes.
+ * @param spec specification that the width is not negative.
+ */
+#define FMT_PLACEHOLDER_SIZE 64
+static void build_placeholder(char *buf, const fmt_spec_t *spec)
+{
+    char *p = buf;
+
+    *p++ = '%';
+    if (spec->flags & FMT_FLAG_ALT) {
+        *p++ = '#';
+    }
+    if (spec->flags & FMT_FLAG_ZERO) {
+        *p++ = '0';
+    }
+    if (spec->flags & FMT_FLAG_LEFT) {
+        *p++ = '-';
+    }
+    if (spec->flags & FMT_FLAG_SPACE) {
+        *p++ = ' ';
+    }
+    if (spec->flags & FMT_FLAG_PLUS) {
+        *p++ = '+';
+    }
+    if (spec->flags & FMT_FLAG_GROUP) {
+        *p++ = '\'';
+    }
+    if (spec->flags & FMT_FLAG_I18N) {
+        *p++ = 'I';
+    }
+    if (spec->width != FMT_NONE) {
+        p += snprintf(p, 16, "%d", spec->width);
+    }
+    if (spec->prec != FMT_NONE) {
+        p += snprintf(p, 16, ".%d", spec->prec);
+    }
+    if (spec->lenmod) {
+        *p++ = spec->lenmod;
+    }
+    *p++ = spec->type;
+    *p   = 0;
+}
+
+static const char DEC_DIGITS[] = "00010203040506070809"
+                                "10111213141516171819"
+                                "20212223242526272829"
+                                "30313233343536373839"
+                                "40414243444546474849"
+                                "50515253545556575859"
+                                "60616263646566676869"
+                                "70717273747576777879"
+                                "80818283848586878889"
+                                "90919293949596979899";
+static const char HEX_DIGITS[] = "0123456789abcdef0123456789ABCDEF";
+
+static inline int count_decimal_digits(uint64_t v)
+{
+    int n = 1;
+
+    for (;;) {
+        if (v < 10) {
+            return n;
+        } else if (v < 100) {
+            return n + 1;
+        } else if (v < 1000) {
+            return n + 2;
+        } else if (v < 10000) {
+            return n + 3;
+        }
+        v /= 10000;
+        n += 4;
+    }
+}
+
+/**
+ * @brief write_digits writes ndigit digits of v to the end of dst in the
+ * specified base.
+ * @param dst destination buffer. it must be at least ndigit bytes.
+ * @param ndigit number of digits of v
+ * @param v unsigned value
+ * @param type conversion type: 'o', 'x', 'X' or others for decimal
+ */
+static inline void write_digits(char *dst, int ndigit, uint64_t v, char type)
+{
+    char *p = dst + ndigit;
+
+    switch (type) {
+    case 'o':
+        do {
+            *--p = '0' + (v & 0x7);
+            v >>= 3;
+        } while (v);
+        break;
+
+    case 'x':
+    case 'X': {
+        const char *digits = HEX_DIGITS + ((type == 'X') ? 16 : 0);
+        do {
+            *--p = digits[v & 0xf];
+            v >>= 4;
+        } while (v);
+    } break;
+
+    default:
+        while (v >= 100) {
+            const char *d = DEC_DIGITS + (v % 100) * 2;
+            v /= 100;
+            *--p = d[1];
+            *--p = d[0];
+        }
+        if (v >= 10) {
+            const char *d = DEC_DIGITS + v * 2;
+            *--p = d[1];
+            *--p = d[0];
+        } else {
+            *--p = '0' + v;
+        }
+    }
+}
+
+/**
+ * @brief fmt_int_t is the layout of the converted integer.
+ *  [lpad][prefix][zero][digits][rpad]
+ */
+typedef struct {
+    uint64_t v;     // absolute value
+    char prefix[2]; // sign or "0x"
+    int nprefix;
+    int nzero;  // number of leading zeros
+    int ndigit; // number of digits
+    int lpad;   // number of leading spaces
+    int rpad;   // number of trailing spaces
+} fmt_int_t;
+
+/**
+ * @brief layout_integer calculates the layout of the integer conversion in
+ * the same way as printf in the C locale.
+ * the flags "'" and 'I' are ignored.
+ * @param ic layout of the integer conversion is stored to this.
+ * @param spec specification of the conversion that the width is not negative.
+ * @param v integer value
+ * @return size_t length of the converted string
+ */
+static size_t layout_integer(fmt_int_t *ic, const fmt_spec_t *spec,
+                             lua_Integer v)
+{
+    int body = 0;
+
+    ic->nprefix = 0;
+    ic->nzero   = 0;
+    ic->lpad    = 0;
+    ic->rpad    = 0;
+
+    switch (spec->type) {
+    case 'd':
+    case 'i': {
+        int64_t sv = 0;
+
+        // the argument is converted to the type of the length modifier
+        switch (spec->lenmod) {
+        case 0:
+            sv = (int)v;
+            break;
+        case 'h':
+            sv = (short)v;
+            break;
+        default:
+            sv = (int64_t)v;
+        }
+        if (sv < 0) {
+            ic->v         = -(uint64_t)sv;
+            ic->prefix[0] = '-';
+            ic->nprefix   = 1;
+        } else {
+            ic->v = sv;
+            if (spec->flags & FMT_FLAG_PLUS) {
+                ic->prefix[0] = '+';
+                ic->nprefix   = 1;
+            } else if (spec->flags & FMT_FLAG_SPACE) {
+                ic->prefix[0] = ' ';
+                ic->nprefix   = 1;
             }
+        }
+        ic->ndigit = count_decimal_digits(ic->v);
+    } break;
 
-            // precision field
-            if (*cur == '.') {
-                // skip '.'
-                cur++;
-                while (strchr("1234567890*", *cur)) {
-                    if (*cur == '*') {
-                        int wlen              = DYNSIZE;
-                        const char w[DYNSIZE] = {0};
-
-                        // copy leading format string
-                        COPY2PLACEHOLDER(head, cur - head);
-                        // skip '*'
-                        head = cur + 1;
-
-                        // get precision from argument
-                        nextarg++;
-                        wlen = uint2str(L, (char *)w, wlen, fmt, narg, nextarg);
-                        // copy it to placeholder
-                        COPY2PLACEHOLDER(w, wlen);
-                    }
-                    cur++;
+    default:
+        switch (spec->lenmod) {
+        case 0:
+            ic->v = (unsigned int)v;
+            break;
+        case 'h':
+            ic->v = (unsigned short)v;
+            break;
+        default:
+            ic->v = (uint64_t)v;
+        }
+
+        if (spec->type == 'u') {
+            ic->ndigit = count_decimal_digits(ic->v);
+        } else {
+            int nbit = (ic->v) ? 64 - __builtin_clzll(ic->v) : 1;
+            if (spec->type == 'o') {
+                ic->ndigit = (nbit + 2) / 3;
+            } else {
+                ic->ndigit = (nbit + 3) / 4;
+                if (ic->v && (spec->flags & FMT_FLAG_ALT)) {
+                    ic->prefix[0] = '0';
+                    ic->prefix[1] = spec->type;
+                    ic->nprefix   = 2;
                 }
             }
+        }
+    }
 
-#undef DYNSIZE
+    if (spec->prec != FMT_NONE) {
+        if (spec->prec == 0 && ic->v == 0) {
+            // no characters are output if both value and precision are 0
+            ic->ndigit = 0;
+        } else if (spec->prec > ic->ndigit) {
+            ic->nzero = spec->prec - ic->ndigit;
+        }
+    }
+    if (spec->type == 'o' && (spec->flags & FMT_FLAG_ALT) && !ic->nzero &&
+        (ic->v || !ic->ndigit)) {
+        // the first digit of the alternative form of octal is always 0
+        ic->nzero = 1;
+    }
 
-            // length modifier
-            if (strchr("hljztL", *cur)) {
-                cur++;
-            }
+    body = ic->nprefix + ic->nzero + ic->ndigit;
+    if (spec->width > body) {
+        if (spec->flags & FMT_FLAG_LEFT) {
+            ic->rpad = spec->width - body;
+        } else if ((spec->flags & FMT_FLAG_ZERO) && spec->prec == FMT_NONE) {
+            ic->nzero += spec->width - body;
+        } else {
+            ic->lpad = spec->width - body;
+        }
+        return spec->width;
+    }
+    return body;
+}
+
+/**
+ * @brief write_integer writes the converted integer to dst.
+ * @param dst destination buffer. it must be large enough to store the
+ * length returned by layout_integer.
+ * @return char* pointer to the next of the last written character.
+ */
+static char *write_integer(char *dst, const fmt_int_t *ic, char type)
+{
+    memset(dst, ' ', ic->lpad);
+    dst += ic->lpad;
+    memcpy(dst, ic->prefix, ic->nprefix);
+    dst += ic->nprefix;
+    memset(dst, '0', ic->nzero);
+    dst += ic->nzero;
+    if (ic->ndigit) {
+        write_digits(dst, ic->ndigit, ic->v, type);
+        dst += ic->ndigit;
+    }
+    memset(dst, ' ', ic->rpad);
+    return dst + ic->rpad;
+}
+
+/**
+ * @brief checkintarg returns the integer argument of the integer conversion.
+ * the boolean is converted to 1 or 0.
+ */
+static inline lua_Integer checkintarg(lua_State *L, const fmt_rowpos_t *pos,
+                                      int arg_idx)
+{
+    if (lua_type(L, arg_idx) == LUA_TBOOLEAN) {
+        return lua_toboolean(L, arg_idx);
+    }
+    return checkintegerarg(L, pos, arg_idx);
+}
+
+static void add_integer(fmt_buf_t *b, const fmt_spec_t *spec, lua_Integer v)
+{
+    fmt_int_t ic = {0};
+    size_t len   = layout_integer(&ic, spec, v);
+
+    write_integer(buf_reserve(b, len), &ic, spec->type);
+    b->len += len;
+}
 
-            // type field
-            if (!strchr("diouxXeEfFgGaAcspqm", *cur)) {
-                return luaL_error(L,
-                                  "unsupported type field at '%c' in "
-                                  "format string '%s'",
-                                  *cur, fmt);
+static inline void add_integer_string(lua_State *L, fmt_buf_t *b,
+                                      const fmt_rowpos_t *pos,
+                                      const fmt_spec_t *spec, int arg_idx)
+{
+    add_integer(b, spec, checkintarg(L, pos, arg_idx));
+}
+
+/**
+ * @brief add_padded_number appends the converted number to the buffer with
+ * the padding specified by the width and the flags.
+ *  [lpad][prefix][zero][body][rpad]
+ * @param prefix sign of the number, or NULL.
+ * @param body converted number without the sign.
+ * @param zeropad the '0' flag is applied if non-zero.
+ */
+static void add_padded_number(fmt_buf_t *b, const fmt_spec_t *spec,
+                              const char *prefix, size_t nprefix,
+                              const char *body, size_t len, int zeropad)
+{
+    size_t total = nprefix + len;
+    size_t npad  = 0;
+    char *p      = NULL;
+
+    if (spec->width > 0 && (size_t)spec->width > total) {
+        npad  = (size_t)spec->width - total;
+        total = (size_t)spec->width;
+    }
+    p = buf_reserve(b, total);
+    b->len += total;
+
+    if (npad && !(spec->flags & FMT_FLAG_LEFT) &&
+        !(zeropad && (spec->flags & FMT_FLAG_ZERO))) {
+        memset(p, ' ', npad);
+        p += npad;
+        npad = 0;
+    }
+    memcpy(p, prefix, nprefix);
+    p += nprefix;
+    if (npad && !(spec->flags & FMT_FLAG_LEFT)) {
+        memset(p, '0', npad);
+        p += npad;
+        npad = 0;
+    }
+    memcpy(p, body, len);
+    memset(p + len, ' ', npad);
+}
+
+/**
+ * @brief float_sign returns the sign character of the float conversion, or
+ * 0 if no sign is printed.
+ */
+static inline char float_sign(const fmt_spec_t *spec, double v)
+{
+    if (signbit(v)) {
+        return '-';
+    } else if (spec->flags & FMT_FLAG_PLUS) {
+        return '+';
+    } else if (spec->flags & FMT_FLAG_SPACE) {
+        return ' ';
+    }
+    return 0;
+}
+
+// size of the buffer for shortest_body
+#define FMT_SHORTEST_SIZE (FPCONV_SHORTEST_DIGITS + 16)
+
+/**
+ * @brief shortest_body converts the double to the shortest decimal string
+ * that is converted back to the same double value. the sign is not written.
+ * the digits are printed in the decimal notation if the decimal exponent X
+ * is -4 <= X < 16, otherwise in the scientific notation as the same as %g.
+ * the '#' flag appends ".0" to the integral value in the decimal notation.
+ * @param body buffer of at least FMT_SHORTEST_SIZE bytes.
+ * @return size_t length of the converted string.
+ */
+static size_t shortest_body(const fmt_spec_t *spec, double v, char *body)
+{
+    char digits[FPCONV_SHORTEST_DIGITS];
+    char *p = body;
+    int n   = 0;
+    int e   = 0;
+    int x   = 0;
+
+    if (isinf(v) || isnan(v)) {
+        memcpy(body, isinf(v) ? "inf" : "nan", 3);
+        return 3;
+    }
+
+    n = fpconv_shortest(fabs(v), digits, &e);
+    // decimal exponent of the first digit
+    x = e + n - 1;
+    if (x < -4 || x >= 16) {
+        // d[.ddd]e+XX
+        *p++ = digits[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        if (x < 0) {
+            *p++ = '-';
+            x    = -x;
+        } else {
+            *p++ = '+';
+        }
+        if (x >= 100) {
+            *p++ = '0' + x / 100;
+        }
+        *p++ = '0' + x / 10 % 10;
+        *p++ = '0' + x % 10;
+    } else if (e >= 0) {
+        // ddd000[.0]
+        memcpy(p, digits, n);
+        p += n;
+        memset(p, '0', e);
+        p += e;
+        if (spec->flags & FMT_FLAG_ALT) {
+            *p++ = '.';
+            *p++ = '0';
+        }
+    } else if (x >= 0) {
+        // ddd.ddd
+        memcpy(p, digits, x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, digits + x + 1, n - x - 1);
+        p += n - x - 1;
+    } else {
+        // 0.000ddd
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -x - 1);
+        p += -x - 1;
+        memcpy(p, digits, n);
+        p += n;
+    }
+    return p - body;
+}
+
+static void add_shortest(fmt_buf_t *b, const fmt_spec_t *spec, double v)
+{
+    char sign = float_sign(spec, v);
+    char body[FMT_SHORTEST_SIZE];
+    size_t len = shortest_body(spec, v, body);
+
+    // inf and nan are not padded with zeros
+    add_padded_number(b, spec, &sign, sign != 0, body, len, isfinite(v));
+}
+
+static inline void add_shortest_string(lua_State *L, fmt_buf_t *b,
+                                       const fmt_rowpos_t *pos,
+                                       const fmt_spec_t *spec, int arg_idx)
+{
+    add_shortest(b, spec, (double)checknumarg(L, pos, arg_idx));
+}
+
+/**
+ * @brief fmt_float_t is the layout of the converted double in the decimal,
+ * scientific or hexadecimal notation.
+ *  [lpad][prefix][zero][int][point][frac][exp][rpad]
+ * the integral and fractional parts are the digits placed at the position
+ * pt of the decimal point, and they are filled with '0' out of the digits.
+ */
+typedef struct {
+    char digits[FPCONV_MAX_DIGITS];
+    const char *special; // "inf" or "nan" if not finite
+    char prefix[3];      // sign and "0x"
+    int nprefix;
+    char exp[8]; // exponent part of the scientific or hexadecimal notation
+    int nexp;
+    int ndigit; // number of digits
+    int pt;     // position of the decimal point in the digits
+    int point;  // 1 if the decimal point is printed
+    size_t nint;  // length of the integral part
+    size_t nfrac; // length of the fractional part
+    size_t nzero; // number of leading zeros
+    size_t lpad;  // number of leading spaces
+    size_t rpad;  // number of trailing spaces
+} fmt_float_t;
+
+/**
+ * @brief layout_hex_digits stores the hexadecimal digits and the binary
+ * exponent of the %a conversion in the same way as glibc.
+ * the leading digit is 1 for the normalized values and 0 for the subnormal
+ * values, and it becomes 2 if the rounding carries into it.
+ * @param fc layout of the float conversion.
+ * @param spec specification of the conversion.
+ * @param v finite and non-negative value.
+ */
+static void layout_hex_digits(fmt_float_t *fc, const fmt_spec_t *spec,
+                              double v)
+{
+    const char *xdigits = HEX_DIGITS + ((spec->type == 'A') ? 16 : 0);
+    uint64_t bits       = 0;
+    uint64_t mant       = 0;
+    uint64_t lead       = 0;
+    int e2              = 0;
+    int nhex            = 13;
+    int i               = 0;
+    char *p             = fc->exp;
+
+    memcpy(&bits, &v, sizeof(bits));
+    mant = bits & ((UINT64_C(1) << 52) - 1);
+    e2   = (int)(bits >> 52) & 0x7ff;
+    if (e2) {
+        lead = 1;
+        e2 -= 1023;
+    } else if (mant) {
+        // subnormal
+        e2 = -1022;
+    }
+
+    if (spec->prec != FMT_NONE && spec->prec < nhex) {
+        // round the mantissa to the precision, ties to even
+        int shift     = 4 * (nhex - spec->prec);
+        uint64_t rem  = mant & ((UINT64_C(1) << shift) - 1);
+        uint64_t half = UINT64_C(1) << (shift - 1);
+
+        nhex = spec->prec;
+        mant = ((lead << 52) | mant) >> shift;
+        if (rem > half || (rem == half && (mant & 1))) {
+            mant++;
+        }
+        lead = mant >> (4 * nhex);
+        mant &= (UINT64_C(1) << (4 * nhex)) - 1;
+    }
+
+    fc->digits[0] = xdigits[lead];
+    for (i = nhex; i > 0; i--) {
+        fc->digits[i] = xdigits[mant & 0xf];
+        mant >>= 4;
+    }
+    fc->ndigit = nhex + 1;
+    while (fc->ndigit > 1 && fc->digits[fc->ndigit - 1] == '0') {
+        fc->ndigit--;
+    }
+    fc->pt    = 1;
+    fc->nfrac = (spec->prec == FMT_NONE) ? (size_t)fc->ndigit - 1 :
+                                           (size_t)spec->prec;
+
+    // p+XX
+    *p++ = (spec->type == 'A') ? 'P' : 'p';
+    if (e2 < 0) {
+        *p++ = '-';
+        e2   = -e2;
+    } else {
+        *p++ = '+';
+    }
+    i = count_decimal_digits(e2);
+    write_digits(p, i, e2, 'd');
+    fc->nexp = p + i - fc->exp;
+}
+
+/**
+ * @brief layout_float calculates the layout of the %f, %e, %g and %a
+ * conversions in the same way as printf in the C locale.
+ * the length modifiers and the flags "'" and 'I' are ignored.
+ * @param fc layout of the float conversion is stored to this.
+ * @param spec specification of the conversion that the width is not negative.
+ * @param v double value
+ * @return size_t length of the converted string
+ */
+static size_t layout_float(fmt_float_t *fc, const fmt_spec_t *spec, double v)
+{
+    int upper   = spec->type == 'F' || spec->type == 'E' ||
+                spec->type == 'G' || spec->type == 'A';
+    int prec    = (spec->prec == FMT_NONE) ? 6 : spec->prec;
+    int sci     = spec->type == 'e' || spec->type == 'E';
+    int x       = 0;
+    char sign   = float_sign(spec, v);
+    size_t body = 0;
+
+    fc->nprefix = 0;
+    if (sign) {
+        fc->prefix[fc->nprefix++] = sign;
+    }
+    fc->special = NULL;
+    fc->nexp    = 0;
+    fc->ndigit  = 0;
+    fc->point   = 0;
+    fc->nint    = 0;
+    fc->nfrac   = 0;
+    fc->nzero   = 0;
+    fc->lpad    = 0;
+    fc->rpad    = 0;
+
+    if (isinf(v) || isnan(v)) {
+        fc->special = isinf(v) ? (upper ? "INF" : "inf") :
+                                 (upper ? "NAN" : "nan");
+        fc->nint    = 3;
+    } else {
+        v = fabs(v);
+        switch (spec->type) {
+        case 'f':
+        case 'F':
+            fc->ndigit = fpconv_digits(v, FPCONV_FIXED, prec, fc->digits,
+                                       &fc->pt);
+            fc->nfrac  = prec;
+            break;
+
+        case 'e':
+        case 'E':
+            // a double has at most 767 significant digits
+            fc->ndigit = fpconv_digits(
+                v, FPCONV_EXP, (prec < FPCONV_MAX_DIGITS) ? prec + 1 : prec,
+                fc->digits, &fc->pt);
+            fc->nfrac  = prec;
+            break;
+
+        case 'a':
+        case 'A':
+            fc->prefix[fc->nprefix++] = '0';
+            fc->prefix[fc->nprefix++] = upper ? 'X' : 'x';
+            layout_hex_digits(fc, spec, v);
+            break;
+
+        default: {
+            // the precision is the number of significant digits
+            int alt = spec->flags & FMT_FLAG_ALT;
+
+            if (prec == 0) {
+                prec = 1;
+            }
+            fc->ndigit = fpconv_digits(v, FPCONV_EXP, prec, fc->digits,
+                                       &fc->pt);
+            x          = fc->ndigit ? fc->pt - 1 : 0;
+            sci        = x < -4 || x >= prec;
+            if (alt) {
+                fc->nfrac = sci ? prec - 1 : prec - 1 - x;
+                if (x == prec && fc->ndigit == 1 && fc->digits[0] == '1') {
+                    // glibc keeps no fractional digits if the value is
+                    // rounded up from the decimal notation, e.g.
+                    // printf("%#.2g", 99.5) prints "1.e+02".
+                    char exact[FPCONV_MAX_DIGITS];
+                    int pt = 0;
+                    fpconv_digits(v, FPCONV_EXP, FPCONV_MAX_DIGITS, exact, &pt);
+                    if (pt - 1 < x) {
+                        fc->nfrac = 0;
+                    }
+                }
+            } else if (sci) {
+                // the trailing zeros are removed
+                fc->nfrac = (fc->ndigit > 1) ? fc->ndigit - 1 : 0;
+            } else {
+                fc->nfrac = (fc->ndigit > fc->pt) ? fc->ndigit - fc->pt : 0;
             }
+        }
+        }
 
-            // copy leading format string
-            COPY2PLACEHOLDER(head, cur - head + 1);
-            head = cur + 1;
+        if (fc->ndigit == 0) {
+            // zero
+            fc->pt = 1;
+        }
+        if (sci) {
+            char *p = fc->exp;
 
-            if (*cur == 'm') {
-                // printf %m is printed as strerror(errno) without params
-                lua_checkstack(L, 1);
-                lua_pushstring(L, strerror(errno));
+            x      = fc->pt - 1;
+            fc->pt = 1;
+            *p++   = upper ? 'E' : 'e';
+            if (x < 0) {
+                *p++ = '-';
+                x    = -x;
             } else {
-                nextarg++;
-                if (nextarg > narg) {
-                    return luaL_error(L,
-                                      "not enough arguments for placeholder "
-                                      "'%s' in format string",
-                                      buf);
-                }
-                push_format_string(L, buf, *cur, nextarg);
+                *p++ = '+';
+            }
+            if (x >= 100) {
+                *p++ = '0' + x / 100;
             }
+            *p++     = '0' + x / 10 % 10;
+            *p++     = '0' + x % 10;
+            fc->nexp = p - fc->exp;
         }
-        cur++;
+        fc->nint  = (fc->pt > 0) ? fc->pt : 1;
+        fc->point = fc->nfrac || (spec->flags & FMT_FLAG_ALT);
+    }
+
+    body = fc->nprefix + fc->nint + fc->point + fc->nfrac + fc->nexp;
+    if (spec->width > 0 && (size_t)spec->width > body) {
+        size_t npad = (size_t)spec->width - body;
+        if (spec->flags & FMT_FLAG_LEFT) {
+            fc->rpad = npad;
+        } else if ((spec->flags & FMT_FLAG_ZERO) && !fc->special) {
+            fc->nzero = npad;
+        } else {
+            fc->lpad = npad;
+        }
+        return spec->width;
     }
+    return body;
+}
 
-#undef COPY2PLACEHOLDER
+/**
+ * @brief write_float_digits writes len digits from the position pos of the
+ * digits to dst. the positions out of the digits are filled with '0'.
+ * @return char* pointer to the next of the last written character.
+ */
+static char *write_float_digits(char *dst, const fmt_float_t *fc,
+                                int64_t pos, size_t len)
+{
+    size_t n = 0;
 
-    // push trailing format string
-    if (cur > head) {
-        lua_pushlstring(L, head, cur - head);
+    if (pos < 0) {
+        n = ((uint64_t)-pos < len) ? (size_t)-pos : len;
+        memset(dst, '0', n);
+        dst += n;
+        len -= n;
+        pos = 0;
+    }
+    if (pos < fc->ndigit) {
+        n = ((size_t)(fc->ndigit - pos) < len) ? (size_t)(fc->ndigit - pos) :
+                                                 len;
+        memcpy(dst, fc->digits + pos, n);
+        dst += n;
+        len -= n;
     }
+    memset(dst, '0', len);
+    return dst + len;
+}
 
-    // index of last used argument
-    return nextarg;
+/**
+ * @brief write_float writes the converted double to dst.
+ * @param dst destination buffer. it must be large enough to store the
+ * length returned by layout_float.
+ * @return char* pointer to the next of the last written character.
+ */
+static char *write_float(char *dst, const fmt_float_t *fc)
+{
+    memset(dst, ' ', fc->lpad);
+    dst += fc->lpad;
+    memcpy(dst, fc->prefix, fc->nprefix);
+    dst += fc->nprefix;
+    memset(dst, '0', fc->nzero);
+    dst += fc->nzero;
+    if (fc->special) {
+        memcpy(dst, fc->special, 3);
+        dst += 3;
+    } else {
+        dst = write_float_digits(dst, fc, (int64_t)fc->pt - fc->nint,
+                                 fc->nint);
+        if (fc->point) {
+            *dst++ = '.';
+        }
+        dst = write_float_digits(dst, fc, fc->pt, fc->nfrac);
+        memcpy(dst, fc->exp, fc->nexp);
+        dst += fc->nexp;
+    }
+    memset(dst, ' ', fc->rpad);
+    return dst + fc->rpad;
 }
 
-static int format_lua(lua_State *L)
+static void add_float(fmt_buf_t *b, const fmt_spec_t *spec, double v)
 {
-    const int narg = lua_gettop(L);
-    int lastarg    = format_arguments(L, 1);
-    int unused     = narg - lastarg;
+    // the digits are not cleared since they are written by layout_float
+    fmt_float_t fc;
+    size_t len = layout_float(&fc, spec, v);
 
-    // concat all strings
-    lua_concat(L, lua_gettop(L) - narg);
+    write_float(buf_reserve(b, len), &fc);
+    b->len += len;
+}
 
-    if (unused > 0) {
-        int tblidx = lastarg + 2;
+static inline void add_float_string(lua_State *L, fmt_buf_t *b,
+                                    const fmt_rowpos_t *pos,
+                                    const fmt_spec_t *spec, int arg_idx)
+{
+    add_float(b, spec, (double)checknumarg(L, pos, arg_idx));
+}
 
-        // place result string to the previous position of unused argument table
-        lua_insert(L, lastarg + 1);
-        // create table for unused arguments
-        lua_createtable(L, unused, 0);
-        lua_insert(L, tblidx);
-        for (int i = unused; i > 0; i--) {
-            // push top of stack to unused argument table
-            lua_rawseti(L, tblidx, i);
-        }
-        lua_pushinteger(L, unused);
-        return 3;
+static int argcounterror(lua_State *L, const fmt_rowpos_t *pos,
+                         const char *src, const fmt_spec_t *spec)
+{
+    return rowerror(
+        L, pos,
+        lua_pushfstring(
+            L, "not enough arguments for placeholder '%s' in format string",
+            lua_pushlstring(L, src + spec->src, spec->srclen)));
+}
+
+static inline int checkdynarg(lua_State *L, const fmt_rowpos_t *pos,
+                              const char *src, const fmt_spec_t *spec,
+                              const int narg, int idx)
+{
+    if (idx > narg) {
+        argcounterror(L, pos, src, spec);
+    } else if (lua_type(L, idx) != LUA_TNUMBER) {
+        typeerror(L, pos, idx, "number");
     }
-    return 1;
+    return (int)lua_tonumber(L, idx);
 }
 
-LUALIB_API int luaopen_string_format(lua_State *L)
+/**
+ * @brief resolve_spec resolves the width and precision specified by the
+ * arguments, and advances nextarg to the argument to be converted.
+ * @param L lua state
+ * @param pos position of the row, or NULL if not converting the row.
+ * @param src source format string that the spec refers to.
+ * @param spec specification
+ * @param narg index of the last argument
+ * @param nextarg index of the last used argument. it will be updated.
+ * @param resolved the resolved specification is stored to this if needed.
+ * @return const fmt_spec_t* spec or resolved.
+ */
+static inline const fmt_spec_t *
+resolve_spec(lua_State *L, const fmt_rowpos_t *pos, const char *src,
+             const fmt_spec_t *spec, const int narg, int *nextarg,
+             fmt_spec_t *resolved)
 {
-    lua_pushcfunction(L, format_lua);
+    if (spec->width == FMT_DYNAMIC || spec->prec == FMT_DYNAMIC) {
+        *resolved = *spec;
+        if (spec->width == FMT_DYNAMIC) {
+            // get width from argument
+            (*nextarg)++;
+            resolved->width = checkdynarg(L, pos, src, spec, narg, *nextarg);
+            if (resolved->width < 0) {
+                // negative width is taken as '-' flag followed by positive
+                // width
+                resolved->flags |= FMT_FLAG_LEFT;
+                resolved->width = (resolved->width == INT_MIN) ?
+                                      INT_MAX :
+                                      -resolved->width;
+            }
+        }
+        if (spec->prec == FMT_DYNAMIC) {
+            // get precision from argument
+            (*nextarg)++;
+            resolved->prec = checkdynarg(L, pos, src, spec, narg, *nextarg);
+            if (resolved->prec < 0) {
+                // negative precision is taken as if the precision were
+                // omitted
+                resolved->prec = FMT_NONE;
+            }
+        }
+        spec = resolved;
+    }
+
+    (*nextarg)++;
+    if (*nextarg > narg) {
+        argcounterror(L, pos, src, spec);
+    }
+    return spec;
+}
+
+/**
+ * @brief add_spec_string converts the argument according to the
+ * specification and appends the result string to the buffer.
+ * @param L lua state
+ * @param b output buffer
+ * @param pos position of the row, or NULL if not converting the row.
+ * @param src source format string that the spec refers to.
+ * @param spec specification
+ * @param narg index of the last argument
+ * @param nextarg index of the last used argument. it will be updated.
+ */
+static void add_spec_string(lua_State *L, fmt_buf_t *b,
+                            const fmt_rowpos_t *pos, const char *src,
+                            const fmt_spec_t *spec, const int narg,
+                            int *nextarg)
+{
+    fmt_spec_t resolved = {0};
+
+    ALLOC_SPEC(spec->type);
+    if (spec->type == 'm') {
+        // printf %m is printed as strerror(errno) without params
+        const char *s = strerror(errno);
+        buf_add(b, s, strlen(s));
+        ALLOC_SPEC(0);
+        return;
+    }
+
+    spec = resolve_spec(L, pos, src, spec, narg, nextarg, &resolved);
+    switch (spec->type) {
+    case 'd': // int (decimal)
+    case 'i': // int (decimal) (same as 'd')
+    case 'o': // unsigned int (octal)
+    case 'u': // unsigned int (decimal)
+    case 'x': // unsigned int (hexadecimal)
+    case 'X': // unsigned int (hexadecimal) (uppercase)
+        add_integer_string(L, b, pos, spec, *nextarg);
+        break;
+
+    case 'q': // any (quoted string)
+        add_quoted_string(L, b, *nextarg);
+        break;
+
+    case 'e': // double (scientific)
+    case 'E': // double (scientific) (uppercase)
+    case 'f': // double (decimal)
+    case 'F': // double (decimal) (uppercase)
+    case 'g': // double (scientific or decimal)
+    case 'G': // double (scientific or decimal) (uppercase)
+    case 'a': // double (hexadecimal) (C99)
+    case 'A': // double (hexadecimal) (C99) (uppercase)
+        add_float_string(L, b, pos, spec, *nextarg);
+        break;
+
+    case 'r': // double (shortest round-trip)
+        add_shortest_string(L, b, pos, spec, *nextarg);
+        break;
+
+    case 's': // any (string)
+        add_string(L, b, *nextarg, spec->width, spec->prec,
+                   spec->flags & FMT_FLAG_LEFT);
+        break;
+
+    default: {
+        char buf[FMT_PLACEHOLDER_SIZE] = {0};
+        build_placeholder(buf, spec);
+        add_format_string(L, b, pos, buf, spec->type, *nextarg);
+    }
+    }
+    ALLOC_SPEC(0);
+}
+
+/**
+ * @brief float_len_max returns the upper bound of the length of the %f, %e,
+ * %g and %a conversions without generating the digits.
+ */
+static size_t float_len_max(const fmt_spec_t *spec, double v)
+{
+    size_t prec = (spec->prec == FMT_NONE) ? 6 : (size_t)spec->prec;
+    size_t len  = 1; // sign
+    int e       = 0;
+
+    if (isinf(v) || isnan(v)) {
+        len += 3;
+    } else {
+        switch (spec->type) {
+        case 'f':
+        case 'F':
+            // |v| < 2^e has at most e * log10(2) + 1 integral digits, and the
+            // rounding may add 1 more digit
+            frexp(v, &e);
+            len += ((e > 0) ? (size_t)e * 30103 / 100000 + 2 : 1) + 1 + prec;
+            break;
+        case 'e':
+        case 'E':
+            // d.ddde+XXX
+            len += 2 + prec + 5;
+            break;
+        case 'g':
+        case 'G':
+            // 0.0000ddd or d.ddde+XXX
+            len += ((prec) ? prec : 1) + 6;
+            break;
+        default:
+            // 0xh.hhhp+XXXX
+            len += 4 + ((prec > 13) ? prec : 13) + 6;
+        }
+    }
+    if (spec->width > 0 && (size_t)spec->width > len) {
+        return (size_t)spec->width;
+    }
+    return len;
+}
+
+/**
+ * @brief spec_len_max returns the upper bound of the length of the argument
+ * converted by add_spec_string. the arguments are neither checked nor
+ * converted to a string, so the non-string argument of %s and %q is counted
+ * as empty, and the missing argument is counted as 0. the errors are left to
+ * add_spec_string, so that they are raised in the same order as format().
+ * @param L lua state
+ * @param spec specification
+ * @param narg index of the last argument
+ * @param nextarg index of the last used argument. it will be updated.
+ * @return size_t upper bound of the length of the converted string.
+ */
+static size_t spec_len_max(lua_State *L, const fmt_spec_t *spec,
+                           const int narg, int *nextarg)
+{
+    fmt_spec_t resolved = *spec;
+    size_t len          = 0;
+    int idx             = *nextarg;
+
+    if (spec->width == FMT_DYNAMIC) {
+        int width      = (++idx <= narg) ? (int)lua_tonumber(L, idx) : 0;
+        resolved.width = (width == INT_MIN) ? INT_MAX :
+                         (width < 0)        ? -width :
+                                              width;
+    }
+    if (spec->prec == FMT_DYNAMIC) {
+        int prec      = (++idx <= narg) ? (int)lua_tonumber(L, idx) : 0;
+        resolved.prec = (prec < 0) ? FMT_NONE : prec;
+    }
+    *nextarg = ++idx;
+    if (idx > narg) {
+        return 0;
+    }
+    spec = &resolved;
+
+    switch (spec->type) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        // sign or prefix, and 22 octal digits of 64 bit integer
+        len = 24 + ((spec->prec > 0) ? (size_t)spec->prec : 0);
+        break;
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        return float_len_max(spec, (double)lua_tonumber(L, idx));
+
+    case 'r':
+        len = 1 + FMT_SHORTEST_SIZE;
+        break;
+
+    case 'q':
+        if (lua_type(L, idx) == LUA_TSTRING) {
+            lua_tolstring(L, idx, &len);
+        }
+        // a byte is escaped to 4 bytes at most
+        return len * 4 + 2;
+
+    case 's':
+        if (lua_type(L, idx) == LUA_TSTRING) {
+            lua_tolstring(L, idx, &len);
+        }
+        if (spec->prec >= 0 && (size_t)spec->prec < len) {
+            len = (size_t)spec->prec;
+        }
+        break;
+
+    case 'c':
+        len = 1;
+        break;
+
+    default:
+        // 0x and 16 hex digits of 64 bit pointer
+        len = 18;
+    }
+
+    if (spec->width > 0 && (size_t)spec->width > len) {
+        return (size_t)spec->width;
+    }
+    return len;
+}
+
+/**
+ * @brief measure_spec_string returns the length of the string converted by
+ * add_spec_string without converting it. the arguments are checked in the
+ * same way as add_spec_string.
+ * @param L lua state
+ * @param src source format string that the spec refers to.
+ * @param spec specification
+ * @param narg index of the last argument
+ * @param nextarg index of the last used argument. it will be updated.
+ * @param exact if zero, the upper bound of the length is returned by
+ * spec_len_max without checking the arguments, so that the argument is not
+ * scanned twice by the caller that reserves the buffer before converting.
+ * @return size_t length of the converted string.
+ */
+static size_t measure_spec_string(lua_State *L, const char *src,
+                                  const fmt_spec_t *spec, const int narg,
+                                  int *nextarg, int exact)
+{
+    fmt_spec_t resolved = {0};
+    size_t len          = 0;
+    int idx             = 0;
+
+    if (spec->type == 'm') {
+        return strlen(strerror(errno));
+    }
+
+    if (!exact) {
+        return spec_len_max(L, spec, narg, nextarg);
+    }
+    spec = resolve_spec(L, NULL, src, spec, narg, nextarg, &resolved);
+    idx  = *nextarg;
+
+    switch (spec->type) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X': {
+        fmt_int_t ic = {0};
+        return layout_integer(&ic, spec, checkintarg(L, NULL, idx));
+    }
+
+    case 'q': {
+        const char *s = tolstring(L, idx, &len);
+        len           = quoted_len((const unsigned char *)s, len);
+        lua_pop(L, 1);
+        return len;
+    }
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A': {
+        fmt_float_t fc;
+        return layout_float(&fc, spec, (double)luaL_checknumber(L, idx));
+    }
+
+    case 'r': {
+        double v = (double)luaL_checknumber(L, idx);
+        char body[FMT_SHORTEST_SIZE];
+        len = (float_sign(spec, v) != 0) + shortest_body(spec, v, body);
+    } break;
+
+    case 's':
+        if (lua_type(L, idx) == LUA_TSTRING) {
+            lua_tolstring(L, idx, &len);
+        } else {
+            tolstring(L, idx, &len);
+            lua_pop(L, 1);
+        }
+        if (spec->prec >= 0 && (size_t)spec->prec < len) {
+            len = (size_t)spec->prec;
+        }
+        break;
+
+    case 'c':
+        len = 1;
+        break;
+
+    default: {
+        char buf[FMT_PLACEHOLDER_SIZE] = {0};
+        build_placeholder(buf, spec);
+        return (size_t)snprintf(NULL, 0, buf, lua_topointer(L, idx));
+    }
+    }
+
+    if (spec->width > 0 && (size_t)spec->width > len) {
+        return (size_t)spec->width;
+    }
+    return len;
+}
+
+/**
+ * @brief format arguments and append them to the buffer.
+ * - format argments must be placed after format string.
+ *
+ * @param L lua state
+ * @param b output buffer
+ * @param fmt_idx index of format string
+ * @param narg index of last argument
+ * @return int index of last used argument. if equal to fmt_idx, no argument
+ * was used.
+ */
+static int format_arguments(lua_State *L, fmt_buf_t *b, const int fmt_idx,
+                            const int narg)
+{
+    size_t len       = 0;
+    const char *fmt  = NULL;
+    const char *head = NULL;
+    const char *cur  = NULL;
+    const char *tail = NULL;
+    int nextarg      = fmt_idx;
+    fmt_spec_t spec  = {0};
+
+    if (lua_type(L, fmt_idx) != LUA_TSTRING) {
+        // ignore non-string format string
+        return 0;
+    }
+    fmt  = head = lua_tolstring(L, fmt_idx, &len);
+    tail = fmt + len;
+
+    // parse format specifiers
+    while ((cur = memchr(head, '%', tail - head))) {
+        if (cur[1] == '%') {
+            buf_add(b, head, cur - head + 1);
+            // skip '%%' escape sequence
+            head = cur + 2;
+            continue;
+        }
+
+        // add leading format string
+        buf_add(b, head, cur - head);
+        head        = parse_spec(L, cur, &spec);
+        spec.src    = cur - fmt;
+        spec.srclen = head - cur;
+        add_spec_string(L, b, NULL, fmt, &spec, narg, &nextarg);
+    }
+
+    // add trailing format string
+    buf_add(b, head, tail - head);
+
+    // index of last used argument
+    return nextarg;
+}
+
+/**
+ * @brief measure_specs returns the length of the string formatted from the
+ * specifications in [spec, last) without formatting it.
+ * @param L lua state
+ * @param src source format string that the specs refer to.
+ * @param spec first specification
+ * @param last end of the specifications
+ * @param narg index of last argument
+ * @param nextarg index of the last used argument. it will be updated.
+ * @param exact see measure_spec_string.
+ * @return size_t length of the formatted string.
+ */
+static size_t measure_specs(lua_State *L, const char *src,
+                            const fmt_spec_t *spec, const fmt_spec_t *last,
+                            const int narg, int *nextarg, int exact)
+{
+    size_t len = 0;
+
+    for (; spec < last; spec++) {
+        len += spec->litlen;
+        if (spec->type) {
+            len += measure_spec_string(L, src, spec, narg, nextarg, exact);
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief format_compiled_arguments works the same as format_arguments but
+ * uses the parsed format string instead of parsing it.
+ * @param L lua state
+ * @param b output buffer
+ * @param pos position of the row, or NULL if not converting the row.
+ * @param c parsed format string
+ * @param fmt_idx index of the value placed before the format arguments
+ * @param narg index of last argument
+ * @return int index of last used argument.
+ */
+static int format_compiled_arguments(lua_State *L, fmt_buf_t *b,
+                                     const fmt_rowpos_t *pos,
+                                     const fmt_compiled_t *c,
+                                     const int fmt_idx, const int narg)
+{
+    const char *src        = FMT_COMPILED_SRC(c);
+    const char *txt        = FMT_COMPILED_TXT(c);
+    const fmt_spec_t *spec = c->spec;
+    const fmt_spec_t *last = c->spec + c->nspec;
+    int nextarg            = fmt_idx;
+    int reserved           = 0;
+
+    for (; spec < last; spec++) {
+        if (!reserved && b->cap - b->len < FMT_BUFFER_SIZE / 2) {
+            // the buffer is about to grow. reserve the memory for the rest
+            // of the result at once instead of growing it repeatedly
+            int n = nextarg;
+            buf_reserve(b, measure_specs(L, src, spec, last, narg, &n, 0));
+            reserved = 1;
+        }
+        buf_add(b, txt + spec->lit, spec->litlen);
+        if (spec->type) {
+            add_spec_string(L, b, pos, src, spec, narg, &nextarg);
+        }
+    }
+
+    // index of last used argument
+    return nextarg;
+}
+
+/**
+ * @brief push_result returns the result string placed at the top of the
+ * stack and unused arguments.
+ * @param L lua state
+ * @param narg number of arguments before formatting
+ * @param lastarg index of last used argument
+ * @return int number of return values
+ */
+static int push_result(lua_State *L, const int narg, const int lastarg)
+{
+    int unused = narg - lastarg;
+
+    if (unused > 0) {
+        int tblidx = lastarg + 2;
+
+        // place result string to the previous position of unused argument table
+        lua_insert(L, lastarg + 1);
+        // create table for unused arguments
+        lua_createtable(L, unused, 0);
+        lua_insert(L, tblidx);
+        for (int i = unused; i > 0; i--) {
+            // push top of stack to unused argument table
+            lua_rawseti(L, tblidx, i);
+        }
+        lua_pushinteger(L, unused);
+        return 3;
+    }
+    return 1;
+}
+
+static int compiled_call_lua(lua_State *L)
+{
+    const int narg          = lua_gettop(L);
+    const fmt_compiled_t *c = luaL_checkudata(L, 1, FMT_COMPILED_MT);
+    fmt_buf_t b             = {0};
+    int lastarg             = 0;
+
+    buf_init(L, &b);
+    lastarg = format_compiled_arguments(L, &b, NULL, c, 1, narg);
+    buf_pushresult(&b);
+    // the compiled format itself is never treated as an unused argument
+    return push_result(L, narg, lastarg);
+}
+
+static int compiled_tostring_lua(lua_State *L)
+{
+    lua_pushfstring(L, FMT_COMPILED_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+/**
+ * @brief compile_format parses the format string and stores the
+ * specifications and the unescaped literal text to c.
+ * @param L lua state
+ * @param fmt format string
+ * @param len length of format string
+ * @param c if NULL, only counts the number of specifications and the length
+ * of literal text.
+ * @param txtlen length of literal text is stored to this.
+ * @return size_t number of specifications.
+ */
+static size_t compile_format(lua_State *L, const char *fmt, size_t len,
+                             fmt_compiled_t *c, size_t *txtlen)
+{
+    const char *head = fmt;
+    const char *tail = fmt + len;
+    const char *cur  = NULL;
+    char *txt        = (c) ? (char *)FMT_COMPILED_TXT(c) : NULL;
+    size_t nspec     = 0;
+    size_t n         = 0;
+    size_t lit       = 0;
+    fmt_spec_t spec  = {0};
+
+#define APPEND_TEXT(str, slen)                                                 \
+    do {                                                                       \
+        if (txt) {                                                             \
+            memcpy(txt + n, (str), (slen));                                    \
+        }                                                                      \
+        n += (slen);                                                           \
+    } while (0)
+
+    while ((cur = memchr(head, '%', tail - head))) {
+        if (cur[1] == '%') {
+            // unescape '%%' to '%'
+            APPEND_TEXT(head, cur - head + 1);
+            head = cur + 2;
+            continue;
+        }
+
+        APPEND_TEXT(head, cur - head);
+        head        = parse_spec(L, cur, &spec);
+        spec.lit    = lit;
+        spec.litlen = n - lit;
+        spec.src    = cur - fmt;
+        spec.srclen = head - cur;
+        if (c) {
+            c->spec[nspec] = spec;
+        }
+        nspec++;
+        lit = n;
+    }
+
+    // trailing literal text
+    APPEND_TEXT(head, tail - head);
+    if (n > lit) {
+        if (c) {
+            c->spec[nspec] = (fmt_spec_t){
+                .lit    = lit,
+                .litlen = n - lit,
+            };
+        }
+        nspec++;
+    }
+
+#undef APPEND_TEXT
+
+    *txtlen = n;
+    return nspec;
+}
+
+/**
+ * @brief fmt_shared_t is the compiled format shared by all lua states in the
+ * process. it is followed by the copy of the compiled format.
+ * the entries are immutable and never released once published, so they are
+ * read without locks.
+ */
+typedef struct {
+    uint64_t hash; // hash of the format string
+    size_t size;   // size of the compiled format
+} fmt_shared_t;
+
+#define FMT_SHARED_COMPILED(e) ((const fmt_compiled_t *)((e) + 1))
+
+// maximum number of the shared formats
+#ifndef STRING_FORMAT_SHARED_SIZE
+# define STRING_FORMAT_SHARED_SIZE 1024
+#endif
+// the slots are kept at most half full so that the probing ends soon
+#define FMT_SHARED_NSLOT  (STRING_FORMAT_SHARED_SIZE * 2)
+// the longer format strings are not shared
+#define FMT_SHARED_MAXLEN 1024
+
+static fmt_shared_t *shared_slots[FMT_SHARED_NSLOT];
+static size_t shared_count;
+static size_t shared_hits;
+static size_t shared_misses;
+
+/**
+ * @brief shared_hash returns the FNV-1a hash of the format string.
+ */
+static inline uint64_t shared_hash(const char *fmt, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)fmt[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline int shared_equal(const fmt_shared_t *e, uint64_t hash,
+                               const char *fmt, size_t len)
+{
+    const fmt_compiled_t *c = FMT_SHARED_COMPILED(e);
+
+    return e->hash == hash && c->srclen == len &&
+           memcmp(FMT_COMPILED_SRC(c), fmt, len) == 0;
+}
+
+/**
+ * @brief shared_lookup finds the shared format of the format string.
+ * the slots are filled in the order of the linear probing and never cleared,
+ * so the lookup ends at the first empty slot.
+ * @return const fmt_shared_t* the shared format or NULL if not found.
+ */
+static const fmt_shared_t *shared_lookup(uint64_t hash, const char *fmt,
+                                         size_t len)
+{
+    size_t i = hash % FMT_SHARED_NSLOT;
+
+    for (size_t n = 0; n < FMT_SHARED_NSLOT; n++) {
+        const fmt_shared_t *e = __atomic_load_n(shared_slots + i,
+                                                __ATOMIC_ACQUIRE);
+        if (!e) {
+            break;
+        } else if (shared_equal(e, hash, fmt, len)) {
+            __atomic_fetch_add(&shared_hits, 1, __ATOMIC_RELAXED);
+            return e;
+        }
+        i = (i + 1) % FMT_SHARED_NSLOT;
+    }
+    __atomic_fetch_add(&shared_misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * @brief shared_publish publishes the copy of the compiled format to the
+ * other lua states. the copy is discarded if the registry is full, failed to
+ * allocate the memory, or the same format is published by another thread.
+ */
+static void shared_publish(uint64_t hash, const fmt_compiled_t *c, size_t size)
+{
+    fmt_shared_t *e = NULL;
+    size_t i        = hash % FMT_SHARED_NSLOT;
+
+    if (__atomic_fetch_add(&shared_count, 1, __ATOMIC_RELAXED) >=
+            STRING_FORMAT_SHARED_SIZE ||
+        !(e = malloc(sizeof(fmt_shared_t) + size))) {
+        __atomic_fetch_sub(&shared_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    e->hash = hash;
+    e->size = size;
+    memcpy(e + 1, c, size);
+
+    // the slot is always found since the slots are at most half full
+    for (;;) {
+        fmt_shared_t *cur = NULL;
+
+        if (__atomic_compare_exchange_n(shared_slots + i, &cur, e, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            return;
+        } else if (shared_equal(cur, hash, FMT_COMPILED_SRC(c), c->srclen)) {
+            free(e);
+            __atomic_fetch_sub(&shared_count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        i = (i + 1) % FMT_SHARED_NSLOT;
+    }
+}
+
+/**
+ * @brief new_compiled parses the format string and pushes the compiled
+ * format to the stack.
+ * the format string that is compiled by any lua state in the process is
+ * copied from the shared registry instead of parsing it again.
+ * @param L lua state
+ * @param fmt format string
+ * @param len length of format string
+ * @return fmt_compiled_t* compiled format
+ */
+static fmt_compiled_t *new_compiled(lua_State *L, const char *fmt, size_t len)
+{
+    int shared            = len <= FMT_SHARED_MAXLEN;
+    uint64_t hash         = 0;
+    const fmt_shared_t *e = NULL;
+    size_t txtlen         = 0;
+    size_t nspec          = 0;
+    size_t size           = 0;
+    fmt_compiled_t *c     = NULL;
+
+    if (shared) {
+        hash = shared_hash(fmt, len);
+        e    = shared_lookup(hash, fmt, len);
+        if (e) {
+            c = lua_newuserdata(L, e->size);
+            memcpy(c, FMT_SHARED_COMPILED(e), e->size);
+            luaL_getmetatable(L, FMT_COMPILED_MT);
+            lua_setmetatable(L, -2);
+            return c;
+        }
+    }
+
+    nspec = compile_format(L, fmt, len, NULL, &txtlen);
+    size  = sizeof(fmt_compiled_t) + sizeof(fmt_spec_t) * nspec + len + 1 +
+           txtlen;
+    c         = lua_newuserdata(L, size);
+    c->nspec  = nspec;
+    c->srclen = len;
+    c->txtlen = txtlen;
+    memcpy((char *)FMT_COMPILED_SRC(c), fmt, len + 1);
+    compile_format(L, fmt, len, c, &txtlen);
+    luaL_getmetatable(L, FMT_COMPILED_MT);
+    lua_setmetatable(L, -2);
+
+    if (shared) {
+        shared_publish(hash, c, size);
+    }
+    return c;
+}
+
+static int compile_lua(lua_State *L)
+{
+    size_t len      = 0;
+    const char *fmt = luaL_checklstring(L, 1, &len);
+
+    new_compiled(L, fmt, len);
+    return 1;
+}
+
+/**
+ * the latency histogram has the log-bucketed buckets like HdrHistogram.
+ * the values less than 2 * FMT_HIST_SUB nanoseconds are counted exactly, and
+ * each power of two range above them is divided into FMT_HIST_SUB buckets, so
+ * the relative error of the value is less than 1 / FMT_HIST_SUB.
+ * the values are counted by hist_bucket so that the powers of two are the
+ * highest values of the buckets.
+ */
+#define FMT_HIST_SUB_BITS 3
+#define FMT_HIST_SUB      (1 << FMT_HIST_SUB_BITS)
+#define FMT_HIST_NBUCKET  ((64 - FMT_HIST_SUB_BITS + 1) * FMT_HIST_SUB)
+
+/**
+ * @brief hist_index returns the index of the bucket of the value.
+ */
+static inline size_t hist_index(uint64_t v)
+{
+    int e = 0;
+
+    if (v < 2 * FMT_HIST_SUB) {
+        return (size_t)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    return (size_t)(e - FMT_HIST_SUB_BITS) * FMT_HIST_SUB +
+           (size_t)(v >> (e - FMT_HIST_SUB_BITS));
+}
+
+/**
+ * @brief hist_lower returns the lowest value of the bucket.
+ */
+static inline uint64_t hist_lower(size_t idx)
+{
+    if (idx < 2 * FMT_HIST_SUB) {
+        return idx;
+    }
+    return (uint64_t)(idx % FMT_HIST_SUB + FMT_HIST_SUB)
+           << (idx / FMT_HIST_SUB - 1);
+}
+
+/**
+ * @brief hist_upper returns the highest value of the bucket.
+ */
+static inline uint64_t hist_upper(size_t idx)
+{
+    if (idx + 1 == FMT_HIST_NBUCKET) {
+        return UINT64_MAX;
+    }
+    return hist_lower(idx + 1) - 1;
+}
+
+/**
+ * @brief hist_bucket returns the index of the bucket that counts the value.
+ * the value is shifted by -1, so the bucket counts the values in
+ * (hist_lower(idx), hist_upper(idx) + 1]. the bucket 0 also counts 0.
+ */
+static inline size_t hist_bucket(uint64_t v)
+{
+    return hist_index(v ? v - 1 : 0);
+}
+
+/**
+ * @brief hist_max returns the highest value counted by the bucket.
+ */
+static inline uint64_t hist_max(size_t idx)
+{
+    uint64_t v = hist_upper(idx);
+    return (v < UINT64_MAX) ? v + 1 : v;
+}
+
+/**
+ * @brief fmt_stat_t is the statistics of the cached format string.
+ */
+typedef struct {
+    uint64_t calls;    // number of calls
+    uint64_t bytes;    // total bytes of the outputs
+    uint64_t nsec;     // total conversion time in nanoseconds
+    uint64_t fast;     // number of the conversions by this module
+    uint64_t fallback; // number of the conversions by snprintf
+    size_t nfast;      // number of the conversions by this module per call
+    size_t nfallback;  // number of the conversions by snprintf per call
+    uint64_t max;      // maximum conversion time in nanoseconds
+    uint64_t hist[FMT_HIST_NBUCKET]; // latency histogram
+} fmt_stat_t;
+
+/**
+ * @brief fmt_cache_t is the LRU cache of compiled formats per lua_State.
+ * the entries are keyed by the address of the format string. the format
+ * strings and the compiled formats are kept alive by storing them in the
+ * anchor table at index slot * 2 + 1 and slot * 2 + 2 so that the addresses
+ * are never reused while they are cached.
+ * the statistics of the entry are allocated while the statistics are enabled,
+ * and released when the entry is evicted.
+ */
+typedef struct {
+    const char *key;         // address of the format string
+    const fmt_compiled_t *c; // compiled format
+    fmt_stat_t *stat;        // statistics or NULL
+    int hnext;               // next entry in the same bucket
+    int prev;                // more recently used entry
+    int next;                // less recently used entry
+} fmt_cache_entry_t;
+
+typedef struct {
+    size_t size;    // maximum number of entries
+    size_t count;   // number of used entries
+    size_t hits;    // number of cache hits
+    size_t misses;  // number of cache misses
+    size_t mask;    // number of buckets - 1
+    int head;       // most recently used entry
+    int tail;       // least recently used entry
+    int *buckets;   // first entry of each bucket
+    fmt_cache_entry_t *entries;
+    size_t nthread; // number of threads of the batch API
+    int stats;      // non-zero if the statistics of the formats are recorded
+} fmt_cache_t;
+
+#define FMT_CACHE_MT          "string.format.cache"
+#define FMT_CACHE_DEFAULT_SIZE 128
+// upvalue index of the cache and the anchor table
+#define FMT_CACHE_UPVALUE     lua_upvalueindex(1)
+#define FMT_ANCHOR_UPVALUE    lua_upvalueindex(2)
+
+static inline size_t cache_hash(const fmt_cache_t *cache, const char *key)
+{
+    uintptr_t h = (uintptr_t)key;
+    return ((h >> 3) ^ (h >> 17)) & cache->mask;
+}
+
+static inline void cache_unlink(fmt_cache_t *cache, fmt_cache_entry_t *e)
+{
+    if (e->prev >= 0) {
+        cache->entries[e->prev].next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if (e->next >= 0) {
+        cache->entries[e->next].prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+}
+
+static inline void cache_link_head(fmt_cache_t *cache, int slot)
+{
+    fmt_cache_entry_t *e = cache->entries + slot;
+
+    e->prev = -1;
+    e->next = cache->head;
+    if (cache->head >= 0) {
+        cache->entries[cache->head].prev = slot;
+    } else {
+        cache->tail = slot;
+    }
+    cache->head = slot;
+}
+
+/**
+ * @brief cache_lookup finds the entry of the key and marks it as the most
+ * recently used entry.
+ * @return int slot of the entry or -1 if not found.
+ */
+static int cache_lookup(fmt_cache_t *cache, const char *key)
+{
+    int slot = cache->buckets[cache_hash(cache, key)];
+
+    while (slot >= 0) {
+        fmt_cache_entry_t *e = cache->entries + slot;
+        if (e->key == key) {
+            if (slot != cache->head) {
+                cache_unlink(cache, e);
+                cache_link_head(cache, slot);
+            }
+            return slot;
+        }
+        slot = e->hnext;
+    }
+    return -1;
+}
+
+/**
+ * @brief cache_insert adds the entry as the most recently used entry. if the
+ * cache is full, the least recently used entry is evicted and its slot is
+ * reused.
+ * @return int slot of the entry.
+ */
+static int cache_insert(fmt_cache_t *cache, const char *key,
+                        const fmt_compiled_t *c)
+{
+    fmt_cache_entry_t *e = NULL;
+    int *bucket          = NULL;
+    int slot             = 0;
+
+    if (cache->count < cache->size) {
+        slot = cache->count++;
+        e    = cache->entries + slot;
+    } else {
+        // evict the least recently used entry
+        slot = cache->tail;
+        e    = cache->entries + slot;
+        cache_unlink(cache, e);
+        free(e->stat);
+        bucket = cache->buckets + cache_hash(cache, e->key);
+        while (*bucket != slot) {
+            bucket = &cache->entries[*bucket].hnext;
+        }
+        *bucket = e->hnext;
+    }
+
+    bucket   = cache->buckets + cache_hash(cache, key);
+    e->key   = key;
+    e->c     = c;
+    e->stat  = NULL;
+    e->hnext = *bucket;
+    *bucket  = slot;
+    cache_link_head(cache, slot);
+
+    return slot;
+}
+
+/**
+ * @brief cache_free_stats releases the statistics of all entries.
+ */
+static void cache_free_stats(fmt_cache_t *cache)
+{
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->entries[i].stat);
+        cache->entries[i].stat = NULL;
+    }
+}
+
+/**
+ * @brief cache_resize discards all entries and changes the capacity of the
+ * cache. the anchor table must be placed at anchor_idx.
+ */
+static void cache_resize(lua_State *L, fmt_cache_t *cache, int anchor_idx,
+                         size_t size)
+{
+    // at least 2 buckets to align the entries placed after the buckets
+    size_t nbucket = 2;
+    int *buckets   = NULL;
+
+    while (nbucket < size) {
+        nbucket <<= 1;
+    }
+    if (size) {
+        buckets = malloc(sizeof(int) * nbucket +
+                         sizeof(fmt_cache_entry_t) * size);
+        if (!buckets) {
+            luaL_error(L, "failed to allocate format cache: %s",
+                       strerror(errno));
+        }
+        for (size_t i = 0; i < nbucket; i++) {
+            buckets[i] = -1;
+        }
+    }
+
+    // release anchored values
+    for (size_t i = 1; i <= cache->count * 2; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, anchor_idx, i);
+    }
+    cache_free_stats(cache);
+    free(cache->buckets);
+
+    cache->size    = size;
+    cache->count   = 0;
+    cache->hits    = 0;
+    cache->misses  = 0;
+    cache->mask    = nbucket - 1;
+    cache->head    = -1;
+    cache->tail    = -1;
+    cache->buckets = buckets;
+    cache->entries = (buckets) ? (fmt_cache_entry_t *)(buckets + nbucket) :
+                                 NULL;
+}
+
+static int cache_gc(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, 1);
+
+    if (cache->buckets) {
+        cache_free_stats(cache);
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    return 0;
+}
+
+/**
+ * @brief push_cached_compiled pushes the compiled format of the format string
+ * at fmt_idx. the format string is compiled and cached if not cached yet.
+ * @return fmt_compiled_t* compiled format
+ */
+static const fmt_compiled_t *push_cached_compiled(lua_State *L,
+                                                  fmt_cache_t *cache,
+                                                  int fmt_idx)
+{
+    size_t len        = 0;
+    const char *fmt   = lua_tolstring(L, fmt_idx, &len);
+    int slot          = cache_lookup(cache, fmt);
+    fmt_compiled_t *c = NULL;
+
+    if (slot >= 0) {
+        cache->hits++;
+        lua_rawgeti(L, FMT_ANCHOR_UPVALUE, slot * 2 + 2);
+        return cache->entries[slot].c;
+    }
+
+    cache->misses++;
+    c    = new_compiled(L, fmt, len);
+    slot = cache_insert(cache, fmt, c);
+    // anchor the format string and the compiled format
+    lua_pushvalue(L, fmt_idx);
+    lua_rawseti(L, FMT_ANCHOR_UPVALUE, slot * 2 + 1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, FMT_ANCHOR_UPVALUE, slot * 2 + 2);
+
+    return c;
+}
+
+static int cache_size_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    size_t prev        = cache->size;
+
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Integer size = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, size >= 0 && size <= INT_MAX / 2, 1,
+                      "size must be between 0 and INT_MAX / 2");
+        cache_resize(L, cache, FMT_ANCHOR_UPVALUE, size);
+    }
+    lua_pushinteger(L, prev);
+    return 1;
+}
+
+static int cache_stats_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, cache->size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, cache->count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, cache->misses);
+    lua_setfield(L, -2, "misses");
+    return 1;
+}
+
+static inline uint64_t getnsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief update_stat records the conversion of the cached format to the
+ * statistics of the entry. the statistics is allocated if not exists.
+ * @param L lua state
+ * @param e cache entry
+ * @param nsec conversion time in nanoseconds
+ * @param nbyte length of the output
+ */
+static void update_stat(lua_State *L, fmt_cache_entry_t *e, uint64_t nsec,
+                        size_t nbyte)
+{
+    fmt_stat_t *stat = e->stat;
+
+    if (!stat) {
+        stat = malloc(sizeof(fmt_stat_t));
+        if (!stat) {
+            luaL_error(L, "failed to allocate statistics: %s",
+                       strerror(errno));
+        }
+        memset(stat, 0, sizeof(fmt_stat_t));
+        for (size_t i = 0; i < e->c->nspec; i++) {
+            switch (e->c->spec[i].type) {
+            case 0:
+                break;
+            case 'c':
+            case 'p':
+                stat->nfallback++;
+                break;
+            default:
+                stat->nfast++;
+            }
+        }
+        e->stat = stat;
+    }
+
+    stat->calls++;
+    stat->bytes += nbyte;
+    stat->nsec += nsec;
+    stat->hist[hist_bucket(nsec)]++;
+    if (nsec > stat->max) {
+        stat->max = nsec;
+    }
+    stat->fast += stat->nfast;
+    stat->fallback += stat->nfallback;
+}
+
+/**
+ * @brief format_stats_arguments works the same as format_cached_arguments and
+ * records the statistics of the cached format string. the statistics are not
+ * recorded while the cache is disabled.
+ */
+static int format_stats_arguments(lua_State *L, fmt_cache_t *cache,
+                                  fmt_buf_t *b, const int fmt_idx,
+                                  const int narg)
+{
+    const char *key         = NULL;
+    const fmt_compiled_t *c = NULL;
+    size_t len              = 0;
+    uint64_t t              = 0;
+    int lastarg             = 0;
+    int slot                = 0;
+
+    if (!cache->size || lua_type(L, fmt_idx) != LUA_TSTRING) {
+        return format_arguments(L, b, fmt_idx, narg);
+    }
+    key = lua_tostring(L, fmt_idx);
+    c   = push_cached_compiled(L, cache, fmt_idx);
+    lua_replace(L, fmt_idx);
+
+    len     = b->len;
+    t       = getnsec();
+    lastarg = format_compiled_arguments(L, b, NULL, c, fmt_idx, narg);
+    t       = getnsec() - t;
+
+    // the entry may be evicted while converting if the __tostring metamethod
+    // calls format(), so it is looked up again. the compiled format is kept
+    // alive by the stack, so its address identifies the entry.
+    slot = cache_lookup(cache, key);
+    if (slot >= 0 && cache->entries[slot].c == c) {
+        update_stat(L, cache->entries + slot, t, b->len - len);
+    }
+    return lastarg;
+}
+
+/**
+ * @brief format_cached_arguments works the same as format_arguments but uses
+ * the cached compiled format if the cache is enabled.
+ * the function must be called from the closure that has the cache upvalues.
+ * @param L lua state
+ * @param b output buffer
+ * @param fmt_idx index of format string. it is replaced with the compiled
+ * format to keep it alive while formatting.
+ * @param narg index of last argument
+ * @return int index of last used argument.
+ */
+static int format_cached_arguments(lua_State *L, fmt_buf_t *b,
+                                   const int fmt_idx, const int narg)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+
+    if (cache->stats) {
+        return format_stats_arguments(L, cache, b, fmt_idx, narg);
+    } else if (cache->size && lua_type(L, fmt_idx) == LUA_TSTRING) {
+        const fmt_compiled_t *c = push_cached_compiled(L, cache, fmt_idx);
+        lua_replace(L, fmt_idx);
+        return format_compiled_arguments(L, b, NULL, c, fmt_idx, narg);
+    }
+    return format_arguments(L, b, fmt_idx, narg);
+}
+
+/**
+ * @brief checkcompiled replaces the format string at fmt_idx with the
+ * compiled format that is cached if the cache is enabled.
+ * the function must be called from the closure that has the cache upvalues.
+ * @return const fmt_compiled_t* compiled format
+ */
+static const fmt_compiled_t *checkcompiled(lua_State *L, const int fmt_idx)
+{
+    fmt_cache_t *cache      = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    size_t len              = 0;
+    const char *fmt         = luaL_checklstring(L, fmt_idx, &len);
+    const fmt_compiled_t *c = NULL;
+
+    if (cache->size) {
+        c = push_cached_compiled(L, cache, fmt_idx);
+    } else {
+        c = new_compiled(L, fmt, len);
+    }
+    lua_replace(L, fmt_idx);
+    return c;
+}
+
+static int len_lua(lua_State *L)
+{
+    const fmt_compiled_t *c = checkcompiled(L, 1);
+    int nextarg             = 1;
+    size_t len = measure_specs(L, FMT_COMPILED_SRC(c), c->spec,
+                               c->spec + c->nspec, lua_gettop(L), &nextarg, 1);
+
+    lua_pushinteger(L, (lua_Integer)len);
+    return 1;
+}
+
+/**
+ * @brief pushrow pushes the elements of the row table at idx to the stack.
+ * the number of elements is the field 'n' if it is a number (e.g. the table
+ * created by table.pack), otherwise the length of the table.
+ * @param pos position of the row
+ * @return int number of the pushed elements.
+ */
+static int pushrow(lua_State *L, const fmt_rowpos_t *pos, int idx)
+{
+    lua_Integer n = 0;
+
+    lua_pushliteral(L, "n");
+    lua_rawget(L, idx);
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        n = lua_tointeger(L, -1);
+    } else {
+        n = (lua_Integer)lua_rawlen(L, idx);
+    }
+    lua_pop(L, 1);
+
+    if (n < 0 || n > INT_MAX - LUA_MINSTACK ||
+        !lua_checkstack(L, (int)n + LUA_MINSTACK)) {
+        rowerror(L, pos, "too many arguments");
+    }
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, idx, i);
+    }
+    return (int)n;
+}
+
+#define FMT_BATCH_MAX_THREADS 256
+// minimum number of rows converted by a thread
+#define FMT_BATCH_MIN_ROWS    1024
+
+/**
+ * @brief fmt_value_t is the argument extracted from the lua state for the
+ * parallel batch conversion. the strings are kept alive by the argument
+ * tables or the anchor table while the workers refer to them.
+ */
+typedef union {
+    lua_Integer i;
+    double d;
+    struct {
+        const char *ptr;
+        size_t len;
+    } s;
+} fmt_value_t;
+
+/**
+ * @brief fmt_batch_t is the rows of the batch API converted by the workers.
+ * the values and the end offsets of the rows are placed in the userdata
+ * memory, so the workers never touch the lua state.
+ */
+typedef struct {
+    const fmt_compiled_t *c;
+    const char *sep;     // separator of the rows, or NULL
+    size_t seplen;       // length of the separator
+    size_t nval;         // number of values of a row
+    size_t nrow;         // number of rows
+    size_t nthread;      // number of threads
+    fmt_value_t *values; // values of the rows
+    fmt_value_t *cur;    // next value to be extracted
+    size_t *ends;        // end offset of each row in the output, or NULL
+    int anchor_idx;      // stack index of the anchor table
+    int nanchor;         // number of anchored strings
+} fmt_batch_t;
+
+typedef struct {
+    const fmt_batch_t *batch;
+    size_t first;      // first row to be converted
+    size_t last;       // end of the rows to be converted
+    fmt_strbuf_t *out; // output of the rows
+    int err;           // errno if failed to grow the output
+} fmt_worker_t;
+
+/**
+ * @brief batch_init prepares the parallel conversion of the batch API if the
+ * number of threads is greater than 1 and the format consists of the
+ * conversions that can be done without the lua state. the memory of the
+ * values and the anchor table are pushed to the stack.
+ * @param L lua state
+ * @param batch batch to be initialized
+ * @param c compiled format
+ * @param nrow number of rows
+ * @param sep separator of the rows, or NULL
+ * @param seplen length of the separator
+ * @param array the end offsets of the rows are recorded if non-zero.
+ * @return int non-zero if the rows are converted in parallel.
+ */
+static int batch_init(lua_State *L, fmt_batch_t *batch, const fmt_compiled_t *c,
+                      size_t nrow, const char *sep, size_t seplen, int array)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    size_t nthread     = nrow / FMT_BATCH_MIN_ROWS;
+    size_t nval        = 0;
+    size_t size        = 0;
+
+    if (nthread > cache->nthread) {
+        nthread = cache->nthread;
+    }
+    if (nthread < 2) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < c->nspec; i++) {
+        const fmt_spec_t *spec = c->spec + i;
+
+        switch (spec->type) {
+        case 0:
+            continue;
+
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        case 'r':
+        case 's':
+        case 'q':
+            if (spec->width != FMT_DYNAMIC && spec->prec != FMT_DYNAMIC) {
+                nval++;
+                continue;
+            }
+        }
+        // '%c', '%p', '%m' and the dynamic width or precision are converted
+        // in the calling thread
+        return 0;
+    }
+
+    if (nval > (SIZE_MAX / 2) / sizeof(fmt_value_t) / nrow) {
+        luaL_error(L, "too many values in batch");
+    }
+    size = nval * nrow * sizeof(fmt_value_t);
+    if (array) {
+        size += nrow * sizeof(size_t);
+    }
+
+    *batch = (fmt_batch_t){
+        .c       = c,
+        .sep     = sep,
+        .seplen  = seplen,
+        .nval    = nval,
+        .nrow    = nrow,
+        .nthread = nthread,
+    };
+    batch->values = lua_newuserdata(L, size ? size : 1);
+    batch->cur    = batch->values;
+    if (array) {
+        batch->ends = (size_t *)(batch->values + nval * nrow);
+    }
+    lua_newtable(L);
+    batch->anchor_idx = lua_gettop(L);
+    return 1;
+}
+
+/**
+ * @brief batch_extract checks the arguments in the same way as
+ * add_spec_string and stores their values to the batch without converting
+ * them. the strings converted from the non-string arguments are kept alive in
+ * the anchor table.
+ * @param L lua state
+ * @param batch batch
+ * @param pos position of the row
+ * @param fmt_idx index of the value placed before the format arguments
+ * @param narg index of last argument
+ */
+static void batch_extract(lua_State *L, fmt_batch_t *batch,
+                          const fmt_rowpos_t *pos, const int fmt_idx,
+                          const int narg)
+{
+    const fmt_compiled_t *c = batch->c;
+    const char *src         = FMT_COMPILED_SRC(c);
+    const fmt_spec_t *spec  = c->spec;
+    const fmt_spec_t *last  = c->spec + c->nspec;
+    fmt_value_t *v          = batch->cur;
+    int nextarg             = fmt_idx;
+
+    for (; spec < last; spec++) {
+        fmt_spec_t resolved = {0};
+
+        if (!spec->type) {
+            continue;
+        }
+        resolve_spec(L, pos, src, spec, narg, &nextarg, &resolved);
+        switch (spec->type) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            v->i = checkintarg(L, pos, nextarg);
+            break;
+
+        case 's':
+        case 'q':
+            if (lua_type(L, nextarg) == LUA_TSTRING) {
+                v->s.ptr = lua_tolstring(L, nextarg, &v->s.len);
+            } else {
+                v->s.ptr = tolstring(L, nextarg, &v->s.len);
+                lua_rawseti(L, batch->anchor_idx, ++batch->nanchor);
+            }
+            break;
+
+        default:
+            v->d = (double)checknumarg(L, pos, nextarg);
+        }
+        v++;
+    }
+    batch->cur = v;
+}
+
+/**
+ * @brief value_len_max returns the upper bound of the length of the value
+ * converted by add_value_string.
+ */
+static size_t value_len_max(const fmt_spec_t *spec, const fmt_value_t *v)
+{
+    size_t len = 0;
+
+    switch (spec->type) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        // sign or prefix, and 22 octal digits of 64 bit integer
+        len = 24 + ((spec->prec > 0) ? (size_t)spec->prec : 0);
+        break;
+
+    case 'r':
+        len = 1 + FMT_SHORTEST_SIZE;
+        break;
+
+    case 's':
+        len = v->s.len;
+        break;
+
+    case 'q':
+        // a byte is escaped to 4 bytes at most
+        return v->s.len * 4 + 2;
+
+    default:
+        return float_len_max(spec, v->d);
+    }
+
+    if (spec->width > 0 && (size_t)spec->width > len) {
+        return (size_t)spec->width;
+    }
+    return len;
+}
+
+static void add_value_string(fmt_buf_t *b, const fmt_spec_t *spec,
+                             const fmt_value_t *v)
+{
+    switch (spec->type) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        add_integer(b, spec, v->i);
+        break;
+
+    case 'q':
+        add_quoted(b, (const unsigned char *)v->s.ptr, v->s.len);
+        break;
+
+    case 'r':
+        add_shortest(b, spec, v->d);
+        break;
+
+    case 's':
+        add_lstring(b, v->s.ptr, v->s.len, spec->width, spec->prec,
+                    spec->flags & FMT_FLAG_LEFT);
+        break;
+
+    default:
+        add_float(b, spec, v->d);
+    }
+}
+
+/**
+ * @brief batch_worker converts the rows in [first, last) to its output.
+ * the output is grown before converting each row to store the row at least,
+ * so the conversion never grows the buffer that requires the lua state.
+ * the failure to grow the output is stored to err and raised by the calling
+ * thread after all workers are joined.
+ */
+static void *batch_worker(void *arg)
+{
+    fmt_worker_t *w          = arg;
+    const fmt_batch_t *batch = w->batch;
+    const fmt_compiled_t *c  = batch->c;
+    const char *txt          = FMT_COMPILED_TXT(c);
+    const fmt_spec_t *last   = c->spec + c->nspec;
+    const fmt_value_t *v     = batch->values + w->first * batch->nval;
+    fmt_buf_t b              = {0};
+
+    buf_attach(NULL, &b, w->out);
+    for (size_t i = w->first; i < w->last; i++) {
+        const fmt_value_t *rv = v;
+        size_t len            = c->txtlen + batch->seplen;
+
+        for (const fmt_spec_t *spec = c->spec; spec < last; spec++) {
+            if (spec->type) {
+                len += value_len_max(spec, rv++);
+            }
+        }
+        if (b.cap - b.len < len) {
+            size_t cap = (b.cap * 2 > b.len + len) ? b.cap * 2 : b.len + len;
+            char *mem  = realloc(b.mem, cap);
+            if (!mem) {
+                w->err = errno;
+                break;
+            }
+            w->out->mem = b.mem = mem;
+            w->out->cap = b.cap = cap;
+        }
+
+        if (batch->sep && i > 0) {
+            buf_add(&b, batch->sep, batch->seplen);
+        }
+        for (const fmt_spec_t *spec = c->spec; spec < last; spec++) {
+            buf_add(&b, txt + spec->lit, spec->litlen);
+            if (spec->type) {
+                ALLOC_SPEC(spec->type);
+                add_value_string(&b, spec, v++);
+                ALLOC_SPEC(0);
+            }
+        }
+        if (batch->ends) {
+            batch->ends[i] = b.len;
+        }
+    }
+    buf_detach(&b);
+    return NULL;
+}
+
+/**
+ * @brief batch_convert converts the extracted rows by the threads, and
+ * appends the outputs to the buffer in order, or stores the rows to the table
+ * at res_idx if the end offsets of the rows are recorded.
+ * the outputs of the threads are pushed to the stack as the buffer userdata
+ * so that they are released on error.
+ */
+static void batch_convert(lua_State *L, fmt_batch_t *batch, fmt_buf_t *b,
+                          int res_idx)
+{
+    size_t nthread = batch->nthread;
+    size_t nper    = (batch->nrow + nthread - 1) / nthread;
+    fmt_worker_t workers[FMT_BATCH_MAX_THREADS];
+    pthread_t tids[FMT_BATCH_MAX_THREADS];
+    int started[FMT_BATCH_MAX_THREADS];
+
+    luaL_checkstack(L, (int)nthread + LUA_MINSTACK, "too many threads");
+    for (size_t k = 0; k < nthread; k++) {
+        fmt_strbuf_t *out = lua_newuserdata(L, sizeof(fmt_strbuf_t));
+
+        *out = (fmt_strbuf_t){0};
+        luaL_getmetatable(L, FMT_STRBUF_MT);
+        lua_setmetatable(L, -2);
+        workers[k] = (fmt_worker_t){
+            .batch = batch,
+            .first = k * nper,
+            .last  = (k + 1) * nper,
+            .out   = out,
+        };
+        if (workers[k].first > batch->nrow) {
+            workers[k].first = batch->nrow;
+        }
+        if (workers[k].last > batch->nrow) {
+            workers[k].last = batch->nrow;
+        }
+    }
+
+    // the calling thread converts the first range
+    for (size_t k = 1; k < nthread; k++) {
+        started[k] = !pthread_create(&tids[k], NULL, batch_worker,
+                                     &workers[k]);
+    }
+    batch_worker(&workers[0]);
+    for (size_t k = 1; k < nthread; k++) {
+        if (started[k]) {
+            pthread_join(tids[k], NULL);
+        } else {
+            // failed to create the thread
+            batch_worker(&workers[k]);
+        }
+    }
+
+    for (size_t k = 0; k < nthread; k++) {
+        if (workers[k].err) {
+            luaL_error(L, "failed to grow buffer: %s",
+                       strerror(workers[k].err));
+        }
+    }
+
+    for (size_t k = 0; k < nthread; k++) {
+        const fmt_worker_t *w = workers + k;
+
+        if (!batch->ends) {
+            buf_add(b, w->out->mem, w->out->len);
+            continue;
+        }
+        for (size_t i = w->first; i < w->last; i++) {
+            size_t head = (i == w->first) ? 0 : batch->ends[i - 1];
+            lua_pushlstring(L, w->out->mem + head, batch->ends[i] - head);
+            lua_rawseti(L, res_idx, (int)i + 1);
+        }
+    }
+}
+
+static int shared_stats_lua(lua_State *L)
+{
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, STRING_FORMAT_SHARED_SIZE);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, __atomic_load_n(&shared_count, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, __atomic_load_n(&shared_hits, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, __atomic_load_n(&shared_misses, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "misses");
+    return 1;
+}
+
+#ifdef STRING_FORMAT_ALLOC_STATS
+typedef struct {
+    lua_Alloc f;
+    void *ud;
+} fmt_allocf_t;
+
+/**
+ * @brief counting_alloc counts the allocations and forwards them to the
+ * original lua_Alloc.
+ */
+static void *counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    fmt_allocf_t *a = ud;
+
+    if (nsize && (!ptr || nsize > osize)) {
+        alloc_count(&alloc_lua, nsize);
+    }
+    return a->f(a->ud, ptr, osize, nsize);
+}
+
+static int alloc_reset_lua(lua_State *L)
+{
+    void *ud    = NULL;
+    lua_Alloc f = lua_getallocf(L, &ud);
+
+    if (f != counting_alloc) {
+        // the original allocator is kept until the process exits since the
+        // lua state uses it until closed
+        fmt_allocf_t *a = malloc(sizeof(fmt_allocf_t));
+        if (!a) {
+            luaL_error(L, "failed to allocate memory: %s", strerror(errno));
+        }
+        a->f  = f;
+        a->ud = ud;
+        lua_setallocf(L, counting_alloc, a);
+    }
+    alloc_lua    = (fmt_alloc_stat_t){0};
+    alloc_malloc = (fmt_alloc_stat_t){0};
+    memset(alloc_specs, 0, sizeof(alloc_specs));
+    return 0;
+}
+
+static void push_alloc_stat(lua_State *L, const fmt_alloc_stat_t *stat)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, __atomic_load_n(&stat->count, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, __atomic_load_n(&stat->bytes, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "bytes");
+}
+
+static int alloc_stats_lua(lua_State *L)
+{
+    lua_createtable(L, 0, 3);
+    push_alloc_stat(L, &alloc_lua);
+    lua_setfield(L, -2, "lua");
+    push_alloc_stat(L, &alloc_malloc);
+    lua_setfield(L, -2, "malloc");
+    lua_newtable(L);
+    for (int i = 1; i < 128; i++) {
+        if (alloc_specs[i].count) {
+            char type[2] = {(char)i, 0};
+            push_alloc_stat(L, alloc_specs + i);
+            lua_setfield(L, -2, type);
+        }
+    }
+    lua_setfield(L, -2, "specs");
+    return 1;
+}
+#endif
+
+static int stats_enable_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    int prev           = cache->stats;
+
+    cache->stats = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+    lua_pushboolean(L, prev);
+    return 1;
+}
+
+static int stats_reset_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+
+    cache_free_stats(cache);
+    return 0;
+}
+
+static int stats_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+
+    lua_newtable(L);
+    for (size_t i = 0; i < cache->count; i++) {
+        const fmt_stat_t *stat = cache->entries[i].stat;
+
+        if (!stat) {
+            continue;
+        }
+        // the format string anchored by the entry
+        lua_rawgeti(L, FMT_ANCHOR_UPVALUE, (int)i * 2 + 1);
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, (lua_Integer)stat->calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushinteger(L, (lua_Integer)stat->bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, (lua_Number)stat->nsec / 1e9);
+        lua_setfield(L, -2, "time");
+        lua_pushinteger(L, (lua_Integer)stat->fast);
+        lua_setfield(L, -2, "fast");
+        lua_pushinteger(L, (lua_Integer)stat->fallback);
+        lua_setfield(L, -2, "fallback");
+        lua_rawset(L, -3);
+    }
+    return 1;
+}
+
+/**
+ * @brief hist_percentile returns the highest value of the bucket that contains
+ * the q-quantile of the recorded values. the value never exceeds the maximum.
+ */
+static uint64_t hist_percentile(const fmt_stat_t *stat, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * (double)stat->calls);
+    uint64_t n    = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (size_t i = 0; i < FMT_HIST_NBUCKET; i++) {
+        n += stat->hist[i];
+        if (n >= rank) {
+            uint64_t v = hist_max(i);
+            return (v < stat->max) ? v : stat->max;
+        }
+    }
+    return stat->max;
+}
+
+static int latency_lua(lua_State *L)
+{
+    fmt_cache_t *cache     = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    const fmt_stat_t *stat = NULL;
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        {"p50",  0.5  },
+        {"p99",  0.99 },
+        {"p999", 0.999},
+    };
+
+    luaL_checktype(L, 1, LUA_TSTRING);
+    lua_settop(L, 1);
+    // the format string may be the other string object of the same content
+    for (size_t i = 0; i < cache->count && !stat; i++) {
+        if (cache->entries[i].stat) {
+            lua_rawgeti(L, FMT_ANCHOR_UPVALUE, (int)i * 2 + 1);
+            if (lua_rawequal(L, 1, -1)) {
+                stat = cache->entries[i].stat;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    if (!stat) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)stat->calls);
+    lua_setfield(L, -2, "count");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        uint64_t v = hist_percentile(stat, percentiles[i].q);
+        lua_pushnumber(L, (lua_Number)v / 1e9);
+        lua_setfield(L, -2, percentiles[i].name);
+    }
+    lua_pushnumber(L, (lua_Number)stat->max / 1e9);
+    lua_setfield(L, -2, "max");
+    return 1;
+}
+
+/**
+ * the upper bounds of the prometheus histogram buckets are the powers of two
+ * nanoseconds from 2^FMT_PROM_MIN_EXP (128ns) to 2^FMT_PROM_MAX_EXP (~17s).
+ * they are the highest values counted by the latency histogram buckets.
+ */
+#define FMT_PROM_MIN_EXP 7
+#define FMT_PROM_MAX_EXP 34
+
+/**
+ * @brief buf_addlabel appends the label set of the format string without the
+ * closing brace to the buffer. the backslash, double-quote and line feed of
+ * the format string are escaped as the label value of the prometheus text
+ * format.
+ */
+static void buf_addlabel(fmt_buf_t *b, const char *fmt, size_t len)
+{
+    buf_add(b, "{format=\"", 9);
+    for (size_t i = 0; i < len; i++) {
+        switch (fmt[i]) {
+        case '\\':
+            buf_add(b, "\\\\", 2);
+            break;
+        case '"':
+            buf_add(b, "\\\"", 2);
+            break;
+        case '\n':
+            buf_add(b, "\\n", 2);
+            break;
+        default:
+            buf_addchar(b, fmt[i]);
+        }
+    }
+    buf_addchar(b, '"');
+}
+
+/**
+ * @brief buf_addseconds appends the nanoseconds as the seconds with 9
+ * fractional digits, so that the value is not rounded.
+ */
+static void buf_addseconds(fmt_buf_t *b, uint64_t nsec)
+{
+    buf_addf(b, "%llu.%09llu", (unsigned long long)(nsec / 1000000000),
+             (unsigned long long)(nsec % 1000000000));
+}
+
+static int prometheus_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    const char *name = luaL_optstring(L, 1, "string_format_duration_seconds");
+    fmt_buf_t b;
+
+    lua_settop(L, 1);
+    buf_init(L, &b);
+    buf_addf(&b,
+             "# HELP %s conversion time of the format string.\n"
+             "# TYPE %s histogram\n",
+             name, name);
+
+    for (size_t k = 0; k < cache->count; k++) {
+        const fmt_stat_t *stat = cache->entries[k].stat;
+        size_t len             = 0;
+        const char *fmt        = NULL;
+        uint64_t n             = 0;
+        size_t i               = 0;
+
+        if (!stat) {
+            continue;
+        }
+        // the format string anchored by the entry
+        lua_rawgeti(L, FMT_ANCHOR_UPVALUE, (int)k * 2 + 1);
+        fmt = lua_tolstring(L, -1, &len);
+        for (int e = FMT_PROM_MIN_EXP; e <= FMT_PROM_MAX_EXP; e++) {
+            // count the values less than or equal to 2^e nanoseconds
+            for (; i <= hist_bucket((uint64_t)1 << e); i++) {
+                n += stat->hist[i];
+            }
+            buf_addf(&b, "%s_bucket", name);
+            buf_addlabel(&b, fmt, len);
+            buf_add(&b, ",le=\"", 5);
+            buf_addseconds(&b, (uint64_t)1 << e);
+            buf_addf(&b, "\"} %llu\n", (unsigned long long)n);
+        }
+        buf_addf(&b, "%s_bucket", name);
+        buf_addlabel(&b, fmt, len);
+        buf_addf(&b, ",le=\"+Inf\"} %llu\n", (unsigned long long)stat->calls);
+        buf_addf(&b, "%s_sum", name);
+        buf_addlabel(&b, fmt, len);
+        buf_add(&b, "} ", 2);
+        buf_addseconds(&b, stat->nsec);
+        buf_addchar(&b, '\n');
+        buf_addf(&b, "%s_count", name);
+        buf_addlabel(&b, fmt, len);
+        buf_addf(&b, "} %llu\n", (unsigned long long)stat->calls);
+        lua_pop(L, 1);
+    }
+    buf_pushresult(&b);
+    return 1;
+}
+
+static int threads_lua(lua_State *L)
+{
+    fmt_cache_t *cache = lua_touserdata(L, FMT_CACHE_UPVALUE);
+    size_t prev        = cache->nthread;
+
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Integer n = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, n >= 1 && n <= FMT_BATCH_MAX_THREADS, 1,
+                      "threads must be between 1 and 256");
+        cache->nthread = (size_t)n;
+    }
+    lua_pushinteger(L, prev);
+    return 1;
+}
+
+static int map_lua(lua_State *L)
+{
+    const fmt_compiled_t *c = checkcompiled(L, 1);
+    size_t seplen           = 0;
+    const char *sep         = NULL;
+    int nrow                = 0;
+    int top                 = 0;
+    int parallel            = 0;
+    fmt_buf_t b             = {0};
+    fmt_batch_t batch       = {0};
+    fmt_rowpos_t pos        = {0};
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    sep = luaL_optlstring(L, 3, NULL, &seplen);
+    lua_settop(L, 3);
+    nrow = (int)lua_rawlen(L, 2);
+    if (sep) {
+        lua_pushnil(L);
+    } else {
+        lua_createtable(L, nrow, 0);
+    }
+    // the buffer is reused for all rows
+    buf_init(L, &b);
+    if (nrow > 0) {
+        parallel = batch_init(L, &batch, c, (size_t)nrow, sep, seplen, !sep);
+    }
+    top = lua_gettop(L);
+    // the row table is placed before its elements
+    pos.base = top + 1;
+
+    for (int i = 1; i <= nrow; i++) {
+        int narg = 0;
+
+        pos.row = i;
+        lua_rawgeti(L, 2, i);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            luaL_argerror(L, 2, lua_pushfstring(
+                                    L, "table expected at index %d, got %s", i,
+                                    luaL_typename(L, -1)));
+        }
+        narg = pushrow(L, &pos, top + 1);
+        if (parallel) {
+            batch_extract(L, &batch, &pos, top + 1, top + 1 + narg);
+            lua_settop(L, top);
+            continue;
+        } else if (!sep) {
+            b.len = 0;
+        } else if (i > 1) {
+            buf_add(&b, sep, seplen);
+        }
+        format_compiled_arguments(L, &b, &pos, c, top + 1, top + 1 + narg);
+        if (!sep) {
+            lua_pushlstring(L, b.mem, b.len);
+            lua_rawseti(L, 4, i);
+        }
+        lua_settop(L, top);
+    }
+
+    if (parallel) {
+        batch_convert(L, &batch, &b, 4);
+    }
+    if (sep) {
+        buf_pushresult(&b);
+        lua_settop(L, 5);
+        return 1;
+    }
+    lua_settop(L, 4);
+    return 1;
+}
+
+static int columns_lua(lua_State *L)
+{
+    const fmt_compiled_t *c = checkcompiled(L, 1);
+    int ncol                = lua_gettop(L) - 2;
+    lua_Integer nrow        = luaL_checkinteger(L, ncol < 0 ? 2 : ncol + 2);
+    int top                 = 0;
+    int parallel            = 0;
+    fmt_buf_t b             = {0};
+    fmt_batch_t batch       = {0};
+    fmt_rowpos_t pos        = {.columns = 1};
+
+    luaL_argcheck(L, nrow >= 0, ncol + 2,
+                  "n must be greater than or equal to 0");
+    luaL_argcheck(L, nrow <= INT_MAX, ncol + 2, "n is too large");
+    for (int k = 2; k <= ncol + 1; k++) {
+        luaL_checktype(L, k, LUA_TTABLE);
+    }
+    lua_settop(L, ncol + 1);
+    buf_init(L, &b);
+    if (nrow > 0) {
+        parallel = batch_init(L, &batch, c, (size_t)nrow, NULL, 0, 0);
+    }
+    top      = lua_gettop(L);
+    pos.base = top;
+    luaL_checkstack(L, ncol + LUA_MINSTACK, "too many columns");
+
+    for (int i = 1; i <= (int)nrow; i++) {
+        pos.row = i;
+        // the i-th element of each column is the argument of the placeholder
+        for (int k = 2; k <= ncol + 1; k++) {
+            lua_rawgeti(L, k, i);
+        }
+        if (parallel) {
+            batch_extract(L, &batch, &pos, top, top + ncol);
+        } else {
+            format_compiled_arguments(L, &b, &pos, c, top, top + ncol);
+        }
+        lua_settop(L, top);
+    }
+
+    if (parallel) {
+        batch_convert(L, &batch, &b, 0);
+    }
+    buf_pushresult(&b);
+    lua_settop(L, b.idx);
+    return 1;
+}
+
+static int format_lua(lua_State *L)
+{
+    fmt_buf_t b = {0};
+    int narg    = 0;
+    int lastarg = 0;
+
+    // remove the module table
+    lua_remove(L, 1);
+    narg = lua_gettop(L);
+    buf_init(L, &b);
+    lastarg = format_cached_arguments(L, &b, 1, narg);
+    buf_pushresult(&b);
+    return push_result(L, narg, lastarg);
+}
+
+static int strbuf_format_lua(lua_State *L)
+{
+    fmt_strbuf_t *sb = luaL_checkudata(L, 1, FMT_STRBUF_MT);
+    fmt_buf_t b      = {0};
+
+    luaL_checkstring(L, 2);
+    buf_attach(L, &b, sb);
+    format_cached_arguments(L, &b, 2, lua_gettop(L));
+    buf_detach(&b);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int strbuf_write_lua(lua_State *L)
+{
+    fmt_strbuf_t *sb = luaL_checkudata(L, 1, FMT_STRBUF_MT);
+    int narg         = lua_gettop(L);
+    fmt_buf_t b      = {0};
+
+    buf_attach(L, &b, sb);
+    for (int i = 2; i <= narg; i++) {
+        size_t len    = 0;
+        const char *s = luaL_checklstring(L, i, &len);
+        buf_add(&b, s, len);
+    }
+    buf_detach(&b);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int strbuf_len_lua(lua_State *L)
+{
+    fmt_strbuf_t *sb = luaL_checkudata(L, 1, FMT_STRBUF_MT);
+
+    lua_pushinteger(L, (lua_Integer)sb->len);
+    return 1;
+}
+
+static int strbuf_reset_lua(lua_State *L)
+{
+    fmt_strbuf_t *sb = luaL_checkudata(L, 1, FMT_STRBUF_MT);
+
+    // keep the memory to reuse it
+    sb->len = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int strbuf_tostring_lua(lua_State *L)
+{
+    fmt_strbuf_t *sb = luaL_checkudata(L, 1, FMT_STRBUF_MT);
+
+    lua_pushlstring(L, sb->mem, sb->len);
+    return 1;
+}
+
+static int strbuf_gc(lua_State *L)
+{
+    fmt_strbuf_t *sb = lua_touserdata(L, 1);
+
+    free(sb->mem);
+    sb->mem = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    return 0;
+}
+
+static int buffer_lua(lua_State *L)
+{
+    lua_Integer cap  = luaL_optinteger(L, 1, FMT_BUFFER_SIZE);
+    fmt_strbuf_t *sb = NULL;
+
+    luaL_argcheck(L, cap >= 0 && (uint64_t)cap <= SIZE_MAX / 2, 1,
+                  "capacity must be greater than or equal to 0");
+    sb  = lua_newuserdata(L, sizeof(fmt_strbuf_t));
+    *sb = (fmt_strbuf_t){0};
+    luaL_getmetatable(L, FMT_STRBUF_MT);
+    lua_setmetatable(L, -2);
+    if (cap) {
+        sb->mem = malloc((size_t)cap);
+        if (!sb->mem) {
+            luaL_error(L, "failed to allocate buffer: %s", strerror(errno));
+        }
+        sb->cap = (size_t)cap;
+    }
+    return 1;
+}
+
+/**
+ * @brief fmt_iov_t is the segment of the output written by format.write.
+ * it refers to the literal text, the string argument or the converted bytes
+ * in the scratch buffer. the scratch buffer may be moved while converting,
+ * so the converted bytes are referred to by the offset.
+ */
+typedef struct {
+    const char *base; // bytes of the segment, or NULL if in the scratch buffer
+    size_t off;       // offset in the scratch buffer
+    size_t len;       // length of the segment
+} fmt_iov_t;
+
+#define FMT_WRITE_NIOV 32
+
+/**
+ * @brief checkfd returns the file descriptor of the integer or the lua file
+ * handle at idx.
+ * @param fp the FILE of the file handle or NULL is stored to this.
+ */
+static int checkfd(lua_State *L, int idx, FILE **fp)
+{
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        lua_Integer fd = luaL_checkinteger(L, idx);
+        luaL_argcheck(L, fd >= 0 && fd <= INT_MAX, idx,
+                      "invalid file descriptor");
+        *fp = NULL;
+        return (int)fd;
+    }
+
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *stream = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+    if (!stream->closef) {
+        luaL_argerror(L, idx, "attempt to use a closed file");
+    }
+    *fp = stream->f;
+#else
+    *fp = *(FILE **)luaL_checkudata(L, idx, LUA_FILEHANDLE);
+    if (!*fp) {
+        luaL_argerror(L, idx, "attempt to use a closed file");
+    }
+#endif
+    return fileno(*fp);
+}
+
+/**
+ * @brief writev_all writes all vectors to fd. the vectors are written by
+ * IOV_MAX at most, and the partially written vector is written again.
+ * @param written number of written bytes is added to this.
+ * @return int 0 on success, -1 on failure with errno.
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt, size_t *written)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *written += (size_t)n;
+        // skip the written vectors
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief write_lua writes the formatted output to the file descriptor or the
+ * file handle without creating the result string.
+ * the literal text and the string arguments of '%s' without width and
+ * precision are written from their memory by writev, and the other
+ * conversions are written to the scratch buffer.
+ */
+static int write_lua(lua_State *L)
+{
+    FILE *fp                = NULL;
+    int fd                  = checkfd(L, 1, &fp);
+    const fmt_compiled_t *c = checkcompiled(L, 2);
+    int narg                = lua_gettop(L);
+    int nextarg             = 2;
+    const fmt_spec_t *spec  = c->spec;
+    const fmt_spec_t *last  = c->spec + c->nspec;
+    fmt_iov_t segbuf[FMT_WRITE_NIOV];
+    struct iovec iovbuf[FMT_WRITE_NIOV];
+    fmt_iov_t *seg     = segbuf;
+    struct iovec *iov  = iovbuf;
+    size_t maxseg      = 0;
+    size_t nseg        = 0;
+    size_t written     = 0;
+    fmt_buf_t b        = {0};
+
+    // each specification has the literal text and the conversion
+    maxseg = c->nspec * 2;
+    if (maxseg > FMT_WRITE_NIOV) {
+        if (maxseg > INT_MAX) {
+            luaL_error(L, "too many placeholders in format string");
+        }
+        seg = lua_newuserdata(L, (sizeof(fmt_iov_t) + sizeof(struct iovec)) *
+                                     maxseg);
+        iov = (struct iovec *)(seg + maxseg);
+    }
+
+    buf_init(L, &b);
+    for (; spec < last; spec++) {
+        if (spec->litlen) {
+            seg[nseg++] = (fmt_iov_t){
+                .base = FMT_COMPILED_TXT(c) + spec->lit,
+                .len  = spec->litlen,
+            };
+        }
+        if (!spec->type) {
+            continue;
+        } else if (spec->type == 's' && spec->width == FMT_NONE &&
+                   spec->prec == FMT_NONE && nextarg < narg &&
+                   lua_type(L, nextarg + 1) == LUA_TSTRING) {
+            // refer to the string argument
+            size_t len     = 0;
+            seg[nseg].base = lua_tolstring(L, ++nextarg, &len);
+            seg[nseg].len  = len;
+            nseg++;
+        } else {
+            size_t off = b.len;
+            add_spec_string(L, &b, NULL, FMT_COMPILED_SRC(c), spec, narg,
+                            &nextarg);
+            if (nseg && !seg[nseg - 1].base) {
+                // join to the previous conversion
+                seg[nseg - 1].len += b.len - off;
+            } else {
+                seg[nseg++] = (fmt_iov_t){
+                    .off = off,
+                    .len = b.len - off,
+                };
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nseg; i++) {
+        iov[i].iov_base = (void *)((seg[i].base) ? seg[i].base :
+                                                   b.mem + seg[i].off);
+        iov[i].iov_len  = seg[i].len;
+    }
+    // flush the buffered data of the file handle to keep the order of output
+    if ((fp && fflush(fp) != 0) ||
+        writev_all(fd, iov, (int)nseg, &written) != 0) {
+        int err = errno;
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        lua_pushinteger(L, err);
+        // the output may have been partially written before the error
+        lua_pushinteger(L, (lua_Integer)written);
+        return 4;
+    }
+    lua_pushinteger(L, (lua_Integer)written);
+    return 1;
+}
+
+/**
+ * @brief setfuncs registers the functions to the table at the top of the
+ * stack below nup upvalues, and pops the upvalues.
+ */
+static void setfuncs(lua_State *L, const struct luaL_Reg *funcs, int nup)
+{
+    for (const struct luaL_Reg *ptr = funcs; ptr->name; ptr++) {
+        for (int i = 0; i < nup; i++) {
+            lua_pushvalue(L, -nup);
+        }
+        lua_pushcclosure(L, ptr->func, nup);
+        lua_setfield(L, -(nup + 2), ptr->name);
+    }
+    lua_pop(L, nup);
+}
+
+LUALIB_API int luaopen_string_format(lua_State *L)
+{
+    struct luaL_Reg compiled_mt[] = {
+        {"__call",     compiled_call_lua    },
+        {"__tostring", compiled_tostring_lua},
+        {NULL,         NULL                 }
+    };
+    struct luaL_Reg cache_mt[] = {
+        {"__gc", cache_gc},
+        {NULL,   NULL    }
+    };
+    struct luaL_Reg strbuf_mt[] = {
+        {"__gc",  strbuf_gc     },
+        {"__len", strbuf_len_lua},
+        {NULL,    NULL          }
+    };
+    struct luaL_Reg strbuf_methods[] = {
+        {"format",   strbuf_format_lua  },
+        {"write",    strbuf_write_lua   },
+        {"len",      strbuf_len_lua     },
+        {"reset",    strbuf_reset_lua   },
+        {"tostring", strbuf_tostring_lua},
+        {NULL,       NULL               }
+    };
+    struct luaL_Reg funcs[] = {
+        {"compile",      compile_lua     },
+        {"buffer",       buffer_lua      },
+        {"write",        write_lua       },
+        {"len",          len_lua         },
+        {"map",          map_lua         },
+        {"columns",      columns_lua     },
+        {"cache_size",   cache_size_lua  },
+        {"cache_stats",  cache_stats_lua },
+        {"shared_stats", shared_stats_lua},
+        {"threads",      threads_lua     },
+        {"stats_enable", stats_enable_lua},
+        {"stats_reset",  stats_reset_lua },
+        {"stats",        stats_lua       },
+        {"latency",      latency_lua     },
+        {"prometheus",   prometheus_lua  },
+#ifdef STRING_FORMAT_ALLOC_STATS
+        {"alloc_reset",  alloc_reset_lua },
+        {"alloc_stats",  alloc_stats_lua },
+#endif
+        {NULL,           NULL            }
+    };
+    struct luaL_Reg callmt[] = {
+        {"__call", format_lua},
+        {NULL,     NULL      }
+    };
+    fmt_cache_t *cache = NULL;
+
+    // create metatables
+    luaL_newmetatable(L, FMT_COMPILED_MT);
+    setfuncs(L, compiled_mt, 0);
+    luaL_newmetatable(L, FMT_CACHE_MT);
+    setfuncs(L, cache_mt, 0);
+    lua_pop(L, 2);
+
+    // create the cache of compiled formats and its anchor table
+    cache = lua_newuserdata(L, sizeof(fmt_cache_t));
+    *cache = (fmt_cache_t){
+        .head    = -1,
+        .tail    = -1,
+        .nthread = 1,
+    };
+    luaL_getmetatable(L, FMT_CACHE_MT);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    cache_resize(L, cache, lua_gettop(L), FMT_CACHE_DEFAULT_SIZE);
+
+    // create metatable of the buffer that the methods share the cache
+    luaL_newmetatable(L, FMT_STRBUF_MT);
+    setfuncs(L, strbuf_mt, 0);
+    lua_newtable(L);
+    lua_pushvalue(L, -4);
+    lua_pushvalue(L, -4);
+    setfuncs(L, strbuf_methods, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    // create module table that can be called as format function
+    lua_newtable(L);
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -3);
+    setfuncs(L, funcs, 2);
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, -4);
+    lua_pushvalue(L, -4);
+    setfuncs(L, callmt, 2);
+    lua_setmetatable(L, -2);
+
     return 1;
 }
@@ -0,0 +1,77 @@
+/**
+ *  Copyright 2018 Ulf Adams
+ *  Copyright (C) 2022 Masatoshi Fukunaga
+ *
+ *  This file is derived from Ryu (https://github.com/ulfjack/ryu) and has
+ *  been modified from the original to be used by this module.
+ *
+ *  The contents of this file may be used under the terms of the Apache
+ *  License, Version 2.0.
+ *
+ *      (See accompanying file LICENSE-Apache2 or copy at
+ *       http://www.apache.org/licenses/LICENSE-2.0)
+ *
+ *  Alternatively, the contents of this file may be used under the terms of
+ *  the Boost Software License, Version 1.0.
+ *
+ *      (See accompanying file LICENSE-Boost or copy at
+ *       https://www.boost.org/LICENSE_1_0.txt)
+ *
+ *  Unless required by applicable law or agreed to in writing, this software
+ *  is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF
+ *  ANY KIND, either express or implied.
+ *
+ */
+
+#ifndef string_format_fpconv_h
+#define string_format_fpconv_h
+
+/**
+ * @brief maximum number of digits stored by fpconv_shortest.
+ */
+#define FPCONV_SHORTEST_DIGITS 17
+
+/**
+ * @brief fpconv_shortest computes the shortest decimal digits that are
+ * converted back to the same double value, by the Ryu algorithm.
+ * if there are several shortest digits, the closest one to v is chosen.
+ * @param v finite and non-negative value.
+ * @param digits the decimal digits without the terminating null byte are
+ * stored to this. it must be at least FPCONV_SHORTEST_DIGITS bytes.
+ * @param exp10 exponent e that v is equal to digits * 10^e is stored to this.
+ * @return int number of the digits.
+ */
+int fpconv_shortest(double v, char *digits, int *exp10);
+
+/**
+ * @brief maximum number of digits stored by fpconv_digits.
+ * the exact decimal expansion of a double has at most 309 integral digits
+ * and 1074 fractional digits.
+ */
+#define FPCONV_MAX_DIGITS 1440
+
+/**
+ * @brief rounding modes of fpconv_digits.
+ */
+enum {
+    FPCONV_FIXED = 0, // round to the prec digits after the decimal point
+    FPCONV_EXP,       // round to the prec significant digits
+};
+
+/**
+ * @brief fpconv_digits computes the decimal digits of v rounded to the
+ * precision in the same way as printf in the C locale.
+ * the digits are computed from the exact value of v, and the ties are
+ * rounded to even.
+ * @param v finite and non-negative value.
+ * @param mode FPCONV_FIXED or FPCONV_EXP.
+ * @param prec precision. it must be greater than 0 if mode is FPCONV_EXP.
+ * @param digits the significant digits without the leading and trailing
+ * zeros are stored to this. it must be at least FPCONV_MAX_DIGITS bytes.
+ * @param decpt position of the decimal point that v is equal to
+ * 0.digits * 10^decpt is stored to this.
+ * @return int number of the digits. 0 if the rounded value is zero.
+ */
+int fpconv_digits(double v, int mode, int prec, char *digits, int *decpt);
+
+#endif
@@ -1,5 +1,9 @@
 local assert = require('assert')
 local format = require('string.format')
+local unpack = unpack or table.unpack
+local find = string.find
+local gettime = require('time.clock').gettime
+local stdout = io.stdout
 local alltests = {}
 local testcase = setmetatable({}, {
     __newindex = function(_, k, v)
@@ -12,6 +16,14 @@ local testcase = setmetatable({}, {
     end,
 })
 
+function testcase.module()
+    -- test that the module is the table that can be called as format function
+    assert.equal(type(format), 'table')
+    assert.equal(type(getmetatable(format).__call), 'function')
+    assert.equal(format('%s', 'foo'), 'foo')
+    assert.equal(getmetatable(format).__call(format, '%d', 1), '1')
+end
+
 function testcase.no_format()
     -- test that format() returns a string
     local s, unused, nunused = format('hello world')
@@ -57,6 +69,10 @@ function testcase.character_format()
     s = format("%c", 65)
     assert.match(s, "A")
 
+    -- test that null character is not truncated
+    s = format("a%cb", 0)
+    assert.equal(s, "a\0b")
+
     -- test that throw error if string length is greater than 1
     local err = assert.throws(format, "%c", 'AB')
     assert.re_match(err, "bad argument #2 .+string length <=1 expected")
@@ -110,6 +126,53 @@ function testcase.string_format()
         assert.re_match(s, v.expected)
     end
 
+    -- test that embedded null bytes are preserved
+    assert.equal(format('[%s]', 'a\0b'), '[a\0b]')
+    assert.equal(format('[%s]', setmetatable({}, {
+        __tostring = function()
+            return 'x\0y'
+        end,
+    })), '[x\0y]')
+
+    -- test that width and precision are applied by byte length
+    for _, v in ipairs({
+        {
+            fmt = '[%-8s]',
+            arg = 'abc',
+        },
+        {
+            fmt = '[%8s]',
+            arg = 'abc',
+        },
+        {
+            fmt = '[%.2s]',
+            arg = 'abc',
+        },
+        {
+            fmt = '[%-8.2s]',
+            arg = 'abc',
+        },
+        {
+            fmt = '[%*.*s]',
+            arg = 'abc',
+        },
+        {
+            fmt = '[%5s]',
+            arg = 123,
+        },
+    }) do
+        local s
+        if find(v.fmt, '*', 1, true) then
+            s = format(v.fmt, -6, 1, v.arg)
+            assert.equal(s, string.format('[%-6.1s]', v.arg))
+        else
+            s = format(v.fmt, v.arg)
+            assert.equal(s, string.format(v.fmt, tostring(v.arg)))
+        end
+    end
+    assert.equal(format('[%-5s]', 'a\0b'), '[a\0b  ]')
+    assert.equal(format('[%.2s]', 'a\0b'), '[a\0]')
+
     -- test that return formatted string and unused arguments
     local s, unused, nunused = format('hello %p', 'error', 'world')
     assert.re_match(s, 'hello (\\(nil\\)|0x[0-9a-f]+)')
@@ -249,6 +312,62 @@ function testcase.quoted_string_format()
         assert.equal(s, v.expected)
     end
 
+    -- test that invalid sequences are replaced in the middle of the runs of
+    -- multibyte characters
+    for _, v in ipairs({
+        {
+            arg = 'あい' .. string.char(0xFF) .. 'う' .. string.char(0xE3, 0x81),
+            expected = '"あい�う�"',
+        },
+        {
+            arg = 'é😀a' .. string.char(0xED, 0xA0, 0x80) .. 'ü',
+            expected = '"é😀a�ü"',
+        },
+        {
+            arg = string.char(0xF0, 0x9F, 0x98) .. '😀' ..
+                string.char(0xC2, 0xE3, 0x81, 0x82),
+            expected = '"�😀�あ"',
+        },
+    }) do
+        local s = format("%q", v.arg)
+        assert.equal(s, v.expected)
+    end
+
+    -- test that the bytes to be escaped are found at any position of the
+    -- long string
+    for n = 0, 70 do
+        local head = string.rep('a', n)
+        for _, v in ipairs({
+            {
+                arg = '"',
+                expected = '\\"',
+            },
+            {
+                arg = '\\',
+                expected = '\\\\',
+            },
+            {
+                arg = '\n',
+                expected = '\\n',
+            },
+            {
+                arg = string.char(0x7F),
+                expected = '\\127',
+            },
+            {
+                arg = 'あ',
+                expected = 'あ',
+            },
+            {
+                arg = string.char(0xFF),
+                expected = '�',
+            },
+        }) do
+            local s = format("%q", head .. v.arg .. 'b')
+            assert.equal(s, '"' .. head .. v.expected .. 'b"')
+        end
+    end
+
     -- test that throw error if %q with modifier
     local err = assert.throws(format, "%-3q", 'a')
     assert.re_match(err, "'%q' cannot have modifiers")
@@ -259,6 +378,67 @@ function testcase.integer_format()
     local s = format('%+d %-5i %05o %u %#x %#X %ld %d %d', 42, 42, 42, 42, 42,
                      42, 42, true, false)
     assert.equal(s, "+42 42    00052 42 0x2a 0X2A 42 1 0")
+
+    -- test that same as string.format
+    for _, v in ipairs({
+        0,
+        1,
+        -1,
+        42,
+        -42,
+        65535,
+        2147483647,
+        -2147483648,
+    }) do
+        for _, flag in ipairs({
+            '',
+            '-',
+            '+',
+            ' ',
+            '0',
+            '#',
+        }) do
+            for _, wp in ipairs({
+                '',
+                '1',
+                '12',
+                '.0',
+                '.3',
+                '12.5',
+            }) do
+                for _, t in ipairs({
+                    'd',
+                    'i',
+                    'o',
+                    'x',
+                    'X',
+                }) do
+                    local fmt = '%' .. flag .. wp .. t
+                    local ok = v >= 0 and not find(flag, '[+ ]')
+                    if t == 'd' or t == 'i' then
+                        ok = flag ~= '#'
+                    end
+                    -- compare only the combinations that string.format accepts
+                    if ok then
+                        assert.equal(format(fmt, v), string.format(fmt, v))
+                    end
+                end
+            end
+        end
+    end
+
+    -- test that the argument is converted to the type of length modifier
+    s = format('%d %x %hd %hx %ld %lx', 2 ^ 32 + 1, -1, 70000, -1, 2 ^ 40,
+               2 ^ 40)
+    assert.equal(s, '1 ffffffff 4464 ffff 1099511627776 10000000000')
+
+    -- test that width and precision can be specified by arguments
+    s = format('%*d|%-*.*x|%.*d', 5, 42, -6, 3, 255, -1, 42)
+    assert.equal(s, '   42|0ff   |42')
+
+    -- test that throw error if argument is not an integer
+    local err = assert.throws(format, '%d', 'foo')
+    assert.re_match(err, 'bad argument #2 .+number expected')
 end
 
 function testcase.float_format()
@@ -267,9 +447,234 @@ function testcase.float_format()
                      1.23, 1.23)
     assert.match(s, "+1.230000e+00 1.23E+00 +1.230000  1.230000 1 1")
 
+    -- test that same as string.format
+    for _, v in ipairs({
+        0,
+        -0.0,
+        0.5,
+        1.5,
+        2.5,
+        -1.23,
+        99.5,
+        0.0001,
+        0.00009995,
+        123456789.125,
+        1e16,
+        -1e-300,
+        5e-324,
+        1.7976931348623157e308,
+        1 / 3,
+        1 / 0,
+        -1 / 0,
+    }) do
+        for _, flag in ipairs({
+            '',
+            '-',
+            '+',
+            ' ',
+            '0',
+            '#',
+        }) do
+            for _, wp in ipairs({
+                '',
+                '1',
+                '12',
+                '.0',
+                '.3',
+                '12.5',
+                '.40',
+            }) do
+                for _, t in ipairs({
+                    'e',
+                    'E',
+                    'f',
+                    'F',
+                    'g',
+                    'G',
+                }) do
+                    local fmt = '%' .. flag .. wp .. t
+                    assert.equal(format(fmt, v), string.format(fmt, v))
+                end
+            end
+        end
+    end
+
+    -- test that ties are rounded to even by the exact value
+    s = format('%.0f %.0f %.0f %.1f %.2f %.1e', 0.5, 1.5, 2.5, 0.25, 1.005,
+               125)
+    assert.equal(s, '0 2 2 0.2 1.00 1.2e+02')
+
+    -- test that all digits of the exact value can be printed
+    s = format('%.60f', 0.1)
+    assert.equal(s,
+                 '0.100000000000000005551115123125782702118158340454101562500000')
+    s = format('%.0f', 2 ^ 100)
+    assert.equal(s, '1267650600228229401496703205376')
+
     -- test that floating point in hexdigit: a, A
     s = format("%a %#A", 1.23, 1.23)
     assert.match(s, "0x1%.[a-f0-9p+]+ 0X1%.[A-F0-9P+]+", false)
+    for _, v in ipairs({
+        {
+            fmt = '%a',
+            arg = 1,
+            expected = '0x1p+0',
+        },
+        {
+            fmt = '%a',
+            arg = -0.0,
+            expected = '-0x0p+0',
+        },
+        {
+            fmt = '%A',
+            arg = 1.23,
+            expected = '0X1.3AE147AE147AEP+0',
+        },
+        {
+            fmt = '%a',
+            arg = 5e-324,
+            expected = '0x0.0000000000001p-1022',
+        },
+        {
+            fmt = '%a',
+            arg = 1.7976931348623157e308,
+            expected = '0x1.fffffffffffffp+1023',
+        },
+        {
+            fmt = '%#a',
+            arg = 0.5,
+            expected = '0x1.p-1',
+        },
+        {
+            fmt = '%.0a',
+            arg = 1.5,
+            expected = '0x2p+0',
+        },
+        {
+            fmt = '%.1a',
+            arg = 1.03125,
+            expected = '0x1.0p+0',
+        },
+        {
+            fmt = '%.1a',
+            arg = 1.09375,
+            expected = '0x1.2p+0',
+        },
+        {
+            fmt = '%.15a',
+            arg = 1,
+            expected = '0x1.000000000000000p+0',
+        },
+        {
+            fmt = '%+012a',
+            arg = 3,
+            expected = '+0x0001.8p+1',
+        },
+        {
+            fmt = '%-10a|',
+            arg = 1 / 0,
+            expected = 'inf       |',
+        },
+    }) do
+        assert.equal(format(v.fmt, v.arg), v.expected)
+    end
+
+    -- test that same as snprintf via string.format if it supports %a
+    if not rawget(_G, 'jit') and pcall(string.format, '%a', 1) then
+        for _ = 1, 1000 do
+            local v = (math.random() - 0.5) * 2 ^ math.random(-1074, 1023)
+            for _, fmt in ipairs({
+                '%a',
+                '%A',
+                '%.0a',
+                '%.3a',
+                '%#.1a',
+                '%+.20a',
+                '%-30a',
+                '% 030.5A',
+            }) do
+                assert.equal(format(fmt, v), string.format(fmt, v))
+            end
+        end
+    end
+end
+
+function testcase.shortest_float_format()
+    -- test that shortest round-trip type: r
+    for _, v in ipairs({
+        {
+            arg = 0.1,
+            expected = '0.1',
+        },
+        {
+            arg = 1 / 3,
+            expected = '0.3333333333333333',
+        },
+        {
+            arg = 100,
+            expected = '100',
+        },
+        {
+            arg = 1e15,
+            expected = '1000000000000000',
+        },
+        {
+            arg = 1e16,
+            expected = '1e+16',
+        },
+        {
+            arg = 0.0001,
+            expected = '0.0001',
+        },
+        {
+            arg = 0.00001,
+            expected = '1e-05',
+        },
+        {
+            arg = -1.5e-300,
+            expected = '-1.5e-300',
+        },
+        {
+            arg = 5e-324,
+            expected = '5e-324',
+        },
+        {
+            arg = 1.7976931348623157e308,
+            expected = '1.7976931348623157e+308',
+        },
+        {
+            arg = 1 / 0,
+            expected = 'inf',
+        },
+        {
+            arg = -1 / 0,
+            expected = '-inf',
+        },
+    }) do
+        local s = format('%r', v.arg)
+        assert.equal(s, v.expected)
+        -- test that the string is converted back to the same value
+        if v.arg == v.arg and v.arg ~= 1 / 0 and v.arg ~= -1 / 0 then
+            assert.equal(tonumber(s), v.arg)
+        end
+    end
+
+    -- test that the string is converted back to the same value
+    for _ = 1, 1000 do
+        local v = (math.random() - 0.5) * 10 ^ math.random(-300, 300)
+        assert.equal(tonumber(format('%r', v)), v)
+    end
+
+    -- test that flags and width are applied
+    assert.equal(format('[%#r|%#r]', 1, 1e16), '[1.0|1e+16]')
+    assert.equal(format('[%+r|% r]', 2.5, 2.5), '[+2.5| 2.5]')
+    assert.equal(format('[%8r|%-8r|%08r]', -2.5, -2.5, -2.5),
+                 '[    -2.5|-2.5    |-00002.5]')
+    assert.equal(format('[%*r]', -6, 1.25), '[1.25  ]')
+
+    -- test that throw error if %r with precision
+    local err = assert.throws(format, "%.3r", 1.5)
+    assert.re_match(err, "'%r' cannot have precision")
 end
 
 function testcase.pointer_format()
@@ -294,10 +699,803 @@ function testcase.unsupported_format()
     -- test that throw error if unsupported format type is specified
     local err = assert.throws(format, "%V")
     assert.match(err, "unsupported type field")
+
+    -- test that throw error if width or precision overflows an int
+    err = assert.throws(format, "%99999999999d", 1)
+    assert.match(err, "too large width in format string")
+    err = assert.throws(format, "%.99999999999f", 1)
+    assert.match(err, "too large precision in format string")
+end
+
+function testcase.long_format()
+    -- test that the result string longer than internal buffer
+    local str = string.rep('x', 4096)
+    local s = format('[%s|%q|%8d|%s]', str, str, 42, 'foo')
+    assert.equal(s, '[' .. str .. '|"' .. str .. '"|      42|foo]')
+
+    -- test that the errors are raised in the order of the placeholders
+    -- even if the buffer is reserved for the rest of the result
+    for i = 1, 2048 do
+        local err = assert.throws(format, '%s%d %*d', string.rep('x', i),
+                                  'foo')
+        assert.match(err, 'number expected, got string')
+    end
+
+    -- test that format() can be called recursively from __tostring
+    local obj = setmetatable({}, {
+        __tostring = function()
+            return format('<%s:%s>', str, 'bar')
+        end,
+    })
+    s = format('%d %s %d', 1, obj, 2)
+    assert.equal(s, '1 <' .. str .. ':bar> 2')
+end
+
+function testcase.many_placeholders()
+    -- test that format string with 100,000 placeholders can be formatted in
+    -- bounded stack space
+    local n = 100000
+    if not pcall(unpack, {}, 1, n) then
+        -- this lua version cannot pass 100,000 arguments to a function
+        n = 7000
+    end
+    local args = {}
+    local exp = {}
+    for i = 1, n do
+        args[i] = i
+        exp[i] = tostring(i)
+    end
+    exp = table.concat(exp, ',') .. ','
+    local fmt = string.rep('%d,', n)
+    local compiled = format.compile(fmt)
+
+    for _, f in ipairs({
+        function()
+            return format(fmt, unpack(args))
+        end,
+        function()
+            return compiled(unpack(args))
+        end,
+    }) do
+        collectgarbage('collect')
+        collectgarbage('stop')
+        local mem = collectgarbage('count')
+        local t = gettime()
+        local s = f()
+        t = gettime() - t
+        mem = collectgarbage('count') - mem
+        collectgarbage('restart')
+        assert.equal(s, exp)
+        -- total memory allocated during the call must be proportional to the
+        -- length of the result string
+        assert.less(mem, #s / 1024 * 32)
+        stdout:write(string.format('(%d placeholders: %.3f sec, %.1f KB) ', n,
+                                   t, mem))
+    end
+end
+
+function testcase.compile()
+    -- test that compile() returns a callable compiled format
+    local f = format.compile('%s: %-*d|%q %%')
+    assert.re_match(tostring(f), '^string.format.compiled: ')
+    local s, unused, nunused = f('foo', 4, 7, 'bar')
+    assert.equal(s, 'foo: 7   |"bar" %')
+    assert.is_nil(unused)
+    assert.is_nil(nunused)
+
+    -- test that return same result as format()
+    for _, fmt in ipairs({
+        'hello world',
+        '',
+        '%d %i %5.2f %x %s %c',
+        '%%%s%%',
+    }) do
+        local args = {
+            42,
+            -42,
+            1.234,
+            255,
+            'foo',
+            65,
+        }
+        assert.equal({
+            format.compile(fmt)(unpack(args)),
+        }, {
+            format(fmt, unpack(args)),
+        })
+    end
+
+    -- test that return unused arguments
+    s, unused, nunused = f('foo', 4, 7, 'bar', 'baz', nil, 'qux', nil)
+    assert.equal(s, 'foo: 7   |"bar" %')
+    assert.equal(unused, {
+        'baz',
+        nil,
+        'qux',
+    })
+    assert.equal(nunused, 4)
+
+    -- test that throw error if not enough arguments
+    local err = assert.throws(f, 'foo', 4)
+    assert.match(err, "not enough arguments for placeholder '%-*d'")
+
+    -- test that throw error if format string is invalid
+    err = assert.throws(format.compile, '%V')
+    assert.match(err, "unsupported type field at 'V'")
+    err = assert.throws(format.compile, 'foo %')
+    assert.match(err, 'missing type field')
+    err = assert.throws(format.compile, '%-3q')
+    assert.match(err, "'%q' cannot have modifiers")
+
+    -- test that throw error if format string is not a string
+    err = assert.throws(format.compile, {})
+    assert.match(err, 'string expected')
+end
+
+function testcase.cache()
+    local size = format.cache_size()
+    assert.equal(size, 128)
+
+    -- test that cache_size() discards cached formats and resets counters
+    assert.equal(format.cache_size(2), 128)
+    assert.equal(format.cache_stats(), {
+        size = 2,
+        count = 0,
+        hits = 0,
+        misses = 0,
+    })
+
+    -- test that the parsed format is cached
+    local fmt = 'hello %s'
+    assert.equal(format(fmt, 'foo'), 'hello foo')
+    assert.equal(format(fmt, 'bar'), 'hello bar')
+    assert.equal(format.cache_stats(), {
+        size = 2,
+        count = 1,
+        hits = 1,
+        misses = 1,
+    })
+
+    -- test that the least recently used format is evicted
+    assert.equal(format('%d', 1), '1')
+    assert.equal(format(fmt, 'baz'), 'hello baz')
+    assert.equal(format('%x', 255), 'ff')
+    assert.equal(format(fmt, 'qux'), 'hello qux')
+    assert.equal(format('%d', 2), '2')
+    assert.equal(format.cache_stats(), {
+        size = 2,
+        count = 2,
+        hits = 3,
+        misses = 4,
+    })
+
+    -- test that invalid format string is not cached
+    assert.throws(format, '%V')
+    assert.equal(format.cache_stats().count, 2)
+
+    -- test that cache can be disabled
+    assert.equal(format.cache_size(0), 2)
+    assert.equal(format(fmt, 'foo'), 'hello foo')
+    assert.equal(format.cache_stats(), {
+        size = 0,
+        count = 0,
+        hits = 0,
+        misses = 0,
+    })
+
+    -- test that throw error if size is invalid
+    local err = assert.throws(format.cache_size, -1)
+    assert.match(err, 'size must be between 0')
+
+    format.cache_size(size)
+end
+
+function testcase.buffer()
+    -- test that buffer() returns an empty buffer
+    local buf = format.buffer(4)
+    assert.equal(buf:len(), 0)
+    assert.equal(buf:tostring(), '')
+
+    -- test that format() and write() append to the buffer
+    assert.equal(buf:format('%d:%s|', 42, 'abc'), buf)
+    assert.equal(buf:write('xyz', 123, 'a\0b'), buf)
+    buf:format('%.2f %q', 1.5, 'q')
+    assert.equal(buf:tostring(), '42:abc|xyz123a\0b1.50 "q"')
+    assert.equal(buf:len(), 24)
+    assert.equal(#buf, 24)
+
+    -- test that the content is not changed if format() fails
+    local err = assert.throws(buf.format, buf, '%d %d', 1)
+    assert.match(err, 'not enough arguments')
+    err = assert.throws(buf.format, buf, '%d', 'foo')
+    assert.match(err, 'number expected')
+    assert.equal(buf:tostring(), '42:abc|xyz123a\0b1.50 "q"')
+
+    -- test that reset() discards the content
+    assert.equal(buf:reset(), buf)
+    assert.equal(buf:len(), 0)
+    assert.equal(buf:tostring(), '')
+
+    -- test that the buffer grows
+    local exp = {}
+    for i = 1, 1000 do
+        buf:format('%05d,', i)
+        exp[i] = string.format('%05d,', i)
+    end
+    assert.equal(buf:tostring(), table.concat(exp))
+
+    -- test that default capacity and zero capacity can be used
+    for _, b in ipairs({
+        format.buffer(),
+        format.buffer(0),
+    }) do
+        b:write('foo'):format('%s', 'bar')
+        assert.equal(b:tostring(), 'foobar')
+    end
+
+    -- test that throw error if capacity is invalid
+    err = assert.throws(format.buffer, -1)
+    assert.match(err, 'capacity must be greater than or equal to 0')
+
+    -- test that throw error if argument is not a string
+    err = assert.throws(buf.write, buf, {})
+    assert.match(err, 'string expected')
+    err = assert.throws(buf.format, buf)
+    assert.match(err, 'string expected')
+end
+
+function testcase.write()
+    local f = assert(io.tmpfile())
+
+    -- test that write() writes the formatted output to the file handle after
+    -- the buffered data
+    f:write('buffered;')
+    local n = format.write(f, 'a%d b%s c%.2f %s|%5s|%q\n', 42, 'str', 1.5,
+                           'a\0b', 'ab', 'q')
+    assert.equal(n, 29)
+    f:seek('set')
+    assert.equal(f:read('*a'), 'buffered;a42 bstr c1.50 a\0b|   ab|"q"\n')
+
+    -- test that format string with many placeholders can be written
+    local args = {}
+    for i = 1, 3000 do
+        args[i] = i % 2 == 0 and 'x' or 'yy'
+    end
+    f:seek('set')
+    n = format.write(f, string.rep('[%s]', #args), unpack(args))
+    assert.equal(n, 10500)
+    f:seek('set')
+    assert.equal(f:read(11), '[yy][x][yy]')
+
+    -- test that throw error if conversion fails
+    local err = assert.throws(format.write, f, '%d', 'foo')
+    assert.match(err, 'number expected')
+    f:close()
+
+    -- test that throw error if file is closed
+    err = assert.throws(format.write, f, 'foo')
+    assert.match(err, 'closed file')
+
+    -- test that return error if write fails
+    local errno, written
+    n, err, errno, written = format.write(9999, 'foo')
+    assert.is_nil(n)
+    assert.equal(type(err), 'string')
+    assert.equal(type(errno), 'number')
+    assert.equal(written, 0)
+
+    -- test that throw error if file is invalid
+    err = assert.throws(format.write, -1, 'foo')
+    assert.match(err, 'invalid file descriptor')
+    err = assert.throws(format.write, {}, 'foo')
+    assert.match(err, 'FILE%* expected', false)
+    err = assert.throws(format.write, 1)
+    assert.match(err, 'string expected')
+end
+
+function testcase.len()
+    -- test that len() returns the length of the formatted string
+    for _, v in ipairs({
+        {
+            'hello %s',
+            'world',
+        },
+        {
+            '%5d|%-5s|%.2s|%%',
+            42,
+            'abc',
+            'xyz',
+        },
+        {
+            '%q',
+            'a"b\\c\n\0\1\0019\127\255あ\237\160\128',
+        },
+        {
+            '%+.3e %#g %f %.0f %a %A %10.3G',
+            1.5,
+            1e-5,
+            -1 / 3,
+            0.5,
+            1.23,
+            5e-324,
+            1e100,
+        },
+        {
+            '%f %e %g',
+            1 / 0,
+            -1 / 0,
+            0 / 0,
+        },
+        {
+            '%.40f %.0f',
+            0.1,
+            2 ^ 100,
+        },
+        {
+            '%r %#r %08r',
+            0.1,
+            1,
+            -2.5,
+        },
+        {
+            '%c%5c %p',
+            65,
+            66,
+            {},
+        },
+        {
+            '%*d %-*.*x %s %s',
+            -6,
+            1,
+            8,
+            4,
+            255,
+            true,
+            nil,
+        },
+    }) do
+        local fmt = v[1]
+        assert.equal(format.len(fmt, unpack(v, 2, 8)),
+                     #format(fmt, unpack(v, 2, 8)))
+    end
+
+    -- test that same length as the string formatted with many placeholders
+    local args = {}
+    for i = 1, 1000 do
+        args[i] = i * 7919
+    end
+    local fmt = string.rep('%d,%s;', #args / 2)
+    assert.equal(format.len(fmt, unpack(args)), #format(fmt, unpack(args)))
+
+    -- test that throw error in the same way as format()
+    local err = assert.throws(format.len, '%d %d', 1)
+    assert.match(err, "not enough arguments for placeholder '%d'")
+    err = assert.throws(format.len, '%d', 'foo')
+    assert.match(err, 'number expected')
+    err = assert.throws(format.len)
+    assert.match(err, 'string expected')
+end
+
+function testcase.map()
+    local rows = {
+        {
+            1,
+            'foo',
+            1.5,
+        },
+        {
+            2,
+            'bar',
+            -0.25,
+        },
+        {
+            3,
+            'baz',
+            1e100,
+        },
+    }
+
+    -- test that map() returns the array of the formatted strings
+    local fmt = '%d,%q,%g'
+    local res = format.map(fmt, rows)
+    assert.equal(#res, #rows)
+    for i, row in ipairs(rows) do
+        assert.equal(res[i], format(fmt, unpack(row)))
+    end
+
+    -- test that map() returns the joined string if sep is specified
+    assert.equal(format.map('%d:%s', rows, '\n'), '1:foo\n2:bar\n3:baz')
+    assert.equal(format.map('[%s]', rows, ''), '[1][2][3]')
+
+    -- test that the field 'n' is used as the number of arguments
+    assert.equal(format.map('%s|%s', {
+        {
+            n = 2,
+        },
+        table.pack and table.pack(nil, 'x') or {
+            n = 2,
+            [2] = 'x',
+        },
+    }, ','), 'nil|nil,nil|x')
+
+    -- test that the unused arguments are ignored
+    assert.equal(format.map('%s', rows, ','), '1,2,3')
+
+    -- test that map() returns empty result if rows is empty
+    assert.equal(format.map('%s', {}), {})
+    assert.equal(format.map('%s', {}, ','), '')
+
+    -- test that the result is not affected by the previous long row
+    local s = string.rep('x', 10000)
+    res = format.map('%s', {
+        {
+            s,
+        },
+        {
+            'y',
+        },
+    })
+    assert.equal(res, {
+        s,
+        'y',
+    })
+
+    -- test that throw error in the same way as format()
+    local err = assert.throws(format.map, '%d %d', rows)
+    assert.match(err, 'number expected')
+    err = assert.throws(format.map, '%d %d', {
+        {
+            1,
+            2,
+        },
+        {
+            3,
+            'foo',
+        },
+    })
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, '(row 2, argument 2: number expected, got string)')
+    err = assert.throws(format.map, '%d %c', {
+        {
+            1,
+            'xy',
+        },
+    }, '\n')
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, '(row 1, argument 2: string length <=1 expected)')
+    err = assert.throws(format.map, '%s %s %s %s', rows)
+    assert.match(err, "not enough arguments for placeholder '%s'")
+    err = assert.throws(format.map, '%d %5.*f', {
+        {
+            1,
+            2,
+            1.5,
+        },
+        {
+            3,
+            4,
+        },
+    })
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, "(row 2: not enough arguments for placeholder '%5.*f'")
+    err = assert.throws(format.map, '%d %*d', {
+        {
+            1,
+            'foo',
+            2,
+        },
+    }, '\n')
+    assert.match(err, '(row 1, argument 2: number expected, got string)')
+    err = assert.throws(format.map, '%s', {
+        {
+            1,
+        },
+        'foo',
+    })
+    assert.match(err, 'table expected at index 2, got string')
+    err = assert.throws(format.map, '%s', 'foo')
+    assert.match(err, 'table expected')
+    err = assert.throws(format.map, {}, rows)
+    assert.match(err, 'string expected')
+end
+
+function testcase.columns()
+    local ids = {
+        1,
+        2,
+        3,
+    }
+    local names = {
+        'foo',
+        'bar',
+        'baz',
+    }
+    local values = {
+        1.5,
+        -0.25,
+        1e100,
+    }
+
+    -- test that columns() feeds the i-th element of each column to the
+    -- placeholders and returns the joined string
+    assert.equal(format.columns('%d,%s,%g\n', ids, names, values, 3),
+                 '1,foo,1.5\n2,bar,-0.25\n3,baz,1e+100\n')
+
+    -- test that only the first n rows are formatted
+    assert.equal(format.columns('[%s]', names, 2), '[foo][bar]')
+    assert.equal(format.columns('[%s]', names, 0), '')
+
+    -- test that the unused columns are ignored
+    assert.equal(format.columns('%s;', names, ids, 3), 'foo;bar;baz;')
+
+    -- test that the format without columns is repeated n times
+    assert.equal(format.columns('-', 3), '---')
+
+    -- test that throw error in the same way as format()
+    local err = assert.throws(format.columns, '%d', names, 3)
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, '(row 1: number expected, got string)')
+    err = assert.throws(format.columns, '%d %d', ids, {
+        1,
+        'foo',
+    }, 2)
+    assert.match(err, 'bad argument #3 ')
+    assert.match(err, '(row 2: number expected, got string)')
+    err = assert.throws(format.columns, '%s %d', names, ids, 4)
+    assert.match(err, 'bad argument #3 ')
+    assert.match(err, '(row 4: number expected, got nil)')
+    err = assert.throws(format.columns, '%d %*d', ids, names, 2)
+    assert.match(err, 'bad argument #3 ')
+    assert.match(err, '(row 1: number expected, got string)')
+    err = assert.throws(format.columns, '%s %s %d', names, ids, 2)
+    assert.match(err, "row 1: not enough arguments for placeholder '%d'")
+    err = assert.throws(format.columns, '%s', names, -1)
+    assert.match(err, 'n must be greater than or equal to 0')
+    err = assert.throws(format.columns, '%s', names)
+    assert.match(err, 'number expected')
+    err = assert.throws(format.columns, '%s', 'foo', 1)
+    assert.match(err, 'table expected')
+end
+
+function testcase.threads()
+    local ids = {}
+    local names = {}
+    local values = {}
+    local rows = {}
+    for i = 1, 5000 do
+        ids[i] = i
+        names[i] = i % 3 == 0 and setmetatable({}, {
+            __tostring = function()
+                return 'obj' .. i
+            end,
+        }) or 'name "' .. i .. '"'
+        values[i] = i / 7
+        rows[i] = {
+            ids[i],
+            names[i],
+            values[i],
+        }
+    end
+
+    -- test that threads() returns the number of threads
+    assert.equal(format.threads(), 1)
+    local fmts = {
+        '%d,%s,%.3f',
+        '[%-6x|%10.4s|%+e|%r|%q]',
+        -- the formats converted in the calling thread
+        '%c%s%g',
+        '%.*s %g',
+    }
+    local expected = {}
+    for i, fmt in ipairs(fmts) do
+        expected[i] = {
+            format.map(fmt, rows),
+            format.map(fmt, rows, '\n'),
+            format.columns(fmt, ids, names, values, #ids),
+        }
+    end
+
+    -- test that the batch APIs return the same result in parallel
+    assert.equal(format.threads(4), 1)
+    assert.equal(format.threads(), 4)
+    for i, fmt in ipairs(fmts) do
+        assert.equal(format.map(fmt, rows), expected[i][1])
+        assert.equal(format.map(fmt, rows, '\n'), expected[i][2])
+        assert.equal(format.columns(fmt, ids, names, values, #ids),
+                     expected[i][3])
+    end
+
+    -- test that throw error in the same way as the calling thread
+    rows[4000] = {
+        1,
+    }
+    local err = assert.throws(format.map, '%d %s', rows)
+    assert.match(err, "(row 4000: not enough arguments for placeholder '%s'")
+    rows[4000] = {
+        1,
+        'foo',
+        'bar',
+    }
+    err = assert.throws(format.map, '%d,%s,%.3f', rows)
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, '(row 4000, argument 3: number expected, got string)')
+    err = assert.throws(format.columns, '%d %s', names, ids, #ids)
+    assert.match(err, 'bad argument #2 ')
+    assert.match(err, '(row 1: number expected, got string)')
+    assert.equal(format.threads(1), 4)
+
+    -- test that throw error if the number of threads is invalid
+    err = assert.throws(format.threads, 0)
+    assert.match(err, 'threads must be between 1 and 256')
+    err = assert.throws(format.threads, 257)
+    assert.match(err, 'threads must be between 1 and 256')
+end
+
+function testcase.shared_stats()
+    -- test that the compiled format is published to the shared registry
+    local stats = format.shared_stats()
+    assert.equal(stats.size, 1024)
+    local fmt = string.format('shared %%d %s', tostring(stats))
+    assert.equal(format.compile(fmt)(1), 'shared 1 ' .. tostring(stats))
+    local prev = stats
+    stats = format.shared_stats()
+    assert.equal(stats.misses, prev.misses + 1)
+    if prev.count == prev.size then
+        -- the registry is filled by the formats of the other tests
+        assert.equal(stats.count, prev.count)
+        return
+    end
+    assert.equal(stats.count, prev.count + 1)
+
+    -- test that the same format string is copied from the shared registry
+    assert.equal(format.compile(fmt)(2), 'shared 2 ' .. tostring(prev))
+    prev = stats
+    stats = format.shared_stats()
+    assert.equal(stats.count, prev.count)
+    assert.equal(stats.hits, prev.hits + 1)
+
+    -- test that the invalid format string is not published
+    assert.throws(format.compile, '%y ' .. fmt)
+    assert.equal(format.shared_stats().count, stats.count)
+end
+
+function testcase.alloc_stats()
+    if not format.alloc_stats then
+        -- the module is not built with STRING_FORMAT_ALLOC_STATS
+        return
+    end
+
+    -- test that the allocations are counted by the conversion type
+    format.alloc_reset()
+    local s = string.rep('x', 4096)
+    assert.equal(format('%s', s), s)
+    local stats = format.alloc_stats()
+    assert.less(0, stats.lua.count)
+    assert.less(4096, stats.specs.s.bytes)
+
+    -- test that the malloc of this module is counted
+    format.alloc_reset()
+    format.buffer(100)
+    stats = format.alloc_stats()
+    assert.equal(stats.malloc, {
+        count = 1,
+        bytes = 100,
+    })
+end
+
+function testcase.stats()
+    -- test that the statistics are not recorded by default
+    format.stats_reset()
+    assert.equal(format('%d', 1), '1')
+    assert.equal(format.stats(), {})
+
+    -- test that the statistics are recorded per format string
+    assert.equal(format.stats_enable(), false)
+    assert.equal(format('%d', 12), '12')
+    assert.equal(format('%d %c', 12, 65), '12 A')
+    assert.equal(format('%d %c', 1, 66), '1 B')
+    format.buffer():format('%d', 345)
+    local stats = format.stats()
+    assert.equal(type(stats['%d'].time), 'number')
+    stats['%d'].time = nil
+    assert.equal(stats['%d'], {
+        calls = 2,
+        bytes = 5,
+        fast = 2,
+        fallback = 0,
+    })
+    stats['%d %c'].time = nil
+    assert.equal(stats['%d %c'], {
+        calls = 2,
+        bytes = 7,
+        fast = 2,
+        fallback = 2,
+    })
+
+    -- test that the statistics are discarded with the cache entry
+    local size = format.cache_size(1)
+    assert.equal(format.stats(), {})
+    assert.equal(format('%d', 1), '1')
+    assert.equal(format('%s', 'foo'), 'foo')
+    stats = format.stats()
+    assert.is_nil(stats['%d'])
+    assert.equal(stats['%s'].calls, 1)
+
+    -- test that the statistics are not recorded while the cache is disabled
+    format.cache_size(0)
+    assert.equal(format('%s', 'foo'), 'foo')
+    assert.equal(format.stats(), {})
+    format.cache_size(size)
+    assert.equal(format('%d', 1), '1')
+
+    -- test that the statistics are not recorded after disabled
+    assert.equal(format.stats_enable(false), true)
+    assert.equal(format('%d', 1), '1')
+    assert.equal(format.stats()['%d'].calls, 1)
+
+    -- test that the statistics are cleared
+    format.stats_reset()
+    assert.equal(format.stats(), {})
+end
+
+function testcase.latency()
+    format.stats_reset()
+    assert.is_nil(format.latency('%d'))
+
+    -- test that the latency is recorded per format string
+    format.stats_enable()
+    for i = 1, 1000 do
+        assert.equal(format('%d', i), tostring(i))
+    end
+    assert.equal(format('a"b\\c\n%s', 'x'), 'a"b\\c\nx')
+    format.stats_enable(false)
+    local lat = format.latency('%d')
+    assert.equal(lat.count, 1000)
+    assert.less_or_equal(0, lat.p50)
+    assert.less_or_equal(lat.p50, lat.p99)
+    assert.less_or_equal(lat.p99, lat.p999)
+    assert.less_or_equal(lat.p999, lat.max)
+
+    -- test that the histogram is exported as prometheus text format
+    local s = format.prometheus()
+    assert.match(s, '# TYPE string_format_duration_seconds histogram\n')
+    assert.match(s, 'string_format_duration_seconds_bucket{format="%d",' ..
+                     'le="0.000000128"} ')
+    assert.match(s, 'string_format_duration_seconds_bucket{format="%d",' ..
+                     'le="+Inf"} 1000\n')
+    assert.match(s, 'string_format_duration_seconds_count{format="%d"} 1000\n')
+    assert.match(s, 'string_format_duration_seconds_count{format=' ..
+                     '"a\\"b\\\\c\\n%s"} 1\n')
+
+    -- test that the bucket counts the duration less than or equal to le
+    format.stats_reset()
+    format.stats_enable()
+    assert.equal(format('le %d', 1), 'le 1')
+    format.stats_enable(false)
+    local max = format.latency('le %d').max
+    local nbucket = 0
+    s = format.prometheus()
+    for le, n in string.gmatch(s, 'string_format_duration_seconds_bucket' ..
+                                   '{format="le %%d",le="([^"]+)"} (%d+)\n') do
+        nbucket = nbucket + 1
+        if le ~= '+Inf' then
+            -- test that the bound is 2^e nanoseconds without rounding
+            local ns = 2 ^ (nbucket + 6)
+            assert.equal(le, string.format('%d.%09d', math.floor(ns / 1e9),
+                                           ns % 1e9))
+        end
+        le = le == '+Inf' and math.huge or tonumber(le)
+        assert.equal(tonumber(n), max <= le and 1 or 0)
+    end
+    assert.equal(nbucket, 29)
+    assert.match(s, 'le="1.073741824"} ')
+    assert.match(s, 'le="17.179869184"} ')
+    s = format.prometheus('foo_seconds')
+    assert.match(s, '# TYPE foo_seconds histogram\n')
+    assert.match(s, 'foo_seconds_sum{format="le %d"} ')
+    format.stats_reset()
 end
 
-local gettime = require('time.clock').gettime
-local stdout = io.stdout
 local elapsed = gettime()
 local errs = {}
 print(string.format('Running %d tests...\n', #alltests))